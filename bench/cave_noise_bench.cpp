@@ -0,0 +1,91 @@
+// Compares the interpolated cave noise shape_chunk uses against sampling it at every block: how
+// far the values drift and how many cave blocks end up somewhere else. With --throughput it
+// measures how much faster it is instead.
+#include <cmath>
+#include <chrono>
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <FastNoise/FastNoise.h>
+
+#include "../src/world/caves.hpp"
+#include "../src/world/noise_upsample.hpp"
+
+static constexpr i32 chunk_size = 16;
+static constexpr i32 chunk_volume = chunk_size * chunk_size * chunk_size;
+static constexpr i32 factor = caves::noise_factor;
+static constexpr i32 coarse_size = noise_upsample::coarse_size<chunk_size, factor>;
+static constexpr f32 frequency = caves::frequency;
+static constexpr int seed = 1337;
+// fails if more than this share of the blocks that are cave in either version are only cave in one
+static constexpr f64 max_mismatch = 0.1;
+
+int main(int argc, char **argv) {
+    auto noise = FastNoise::New<FastNoise::Simplex>();
+
+    // the depths caves are generated at
+    std::vector<i32vec3> chunks;
+    for (i32 y = -6; y <= 2; y++)
+        for (i32 z = -4; z < 4; z++)
+            for (i32 x = -4; x < 4; x++)
+                chunks.emplace_back(x, y, z);
+
+    std::vector<f32> full(chunk_volume), upsampled(chunk_volume), coarse(coarse_size * coarse_size * coarse_size);
+    log(LogLevel::INFO, "CaveNoiseBench", "{} chunks, {}^3 grid per chunk instead of {}^3", chunks.size(), coarse_size, chunk_size);
+
+    if (argc > 1 && std::strcmp(argv[1], "--throughput") == 0) {
+        auto time = [&] (auto &&function) {
+            auto start = std::chrono::steady_clock::now();
+            usize iterations = 0;
+            std::chrono::duration<f64> elapsed {};
+            while (elapsed.count() < 1.0) {
+                for (i32vec3 chunk_pos : chunks)
+                    function(chunk_pos * chunk_size);
+                iterations++;
+                elapsed = std::chrono::steady_clock::now() - start;
+            }
+            return (f64)(iterations * chunks.size()) / elapsed.count();
+        };
+        f64 full_rate = time([&] (i32vec3 world_pos) {
+            noise->GenUniformGrid3D(full.data(), world_pos.x, world_pos.y, world_pos.z, chunk_size, chunk_size, chunk_size, frequency, seed);
+        });
+        f64 upsampled_rate = time([&] (i32vec3 world_pos) {
+            noise->GenUniformGrid3D(coarse.data(), world_pos.x / factor, world_pos.y / factor, world_pos.z / factor, coarse_size, coarse_size, coarse_size, frequency * factor, seed);
+            noise_upsample::trilinear<chunk_size, factor>(coarse.data(), upsampled.data());
+        });
+        log(LogLevel::INFO, "CaveNoiseBench", "Full resolution: {} chunks/s, interpolated: {} chunks/s ({}x)", full_rate, upsampled_rate, upsampled_rate / full_rate);
+        return 0;
+    }
+
+    f64 error_sum = 0, squared_error_sum = 0, max_error = 0;
+    usize num_caves = 0, num_either = 0, num_mismatched = 0;
+    for (i32vec3 chunk_pos : chunks) {
+        i32vec3 world_pos = chunk_pos * chunk_size;
+        noise->GenUniformGrid3D(full.data(), world_pos.x, world_pos.y, world_pos.z, chunk_size, chunk_size, chunk_size, frequency, seed);
+        noise->GenUniformGrid3D(coarse.data(), world_pos.x / factor, world_pos.y / factor, world_pos.z / factor, coarse_size, coarse_size, coarse_size, frequency * factor, seed);
+        noise_upsample::trilinear<chunk_size, factor>(coarse.data(), upsampled.data());
+
+        for (i32 i = 0; i < chunk_volume; i++) {
+            f64 error = std::abs(full[i] - upsampled[i]);
+            error_sum += error;
+            squared_error_sum += error * error;
+            max_error = std::max(max_error, error);
+            i32 world_y = world_pos.y + (i / chunk_size) % chunk_size;
+            bool full_cave = caves::is_cave(full[i], world_y), upsampled_cave = caves::is_cave(upsampled[i], world_y);
+            num_caves += full_cave;
+            num_either += full_cave || upsampled_cave;
+            num_mismatched += full_cave != upsampled_cave;
+        }
+    }
+
+    usize num_blocks = chunks.size() * chunk_volume;
+    f64 mismatch = (f64)num_mismatched / (f64)std::max<usize>(num_either, 1);
+    log(LogLevel::INFO, "CaveNoiseBench", "Error: mean {}, rms {}, max {}", error_sum / num_blocks, std::sqrt(squared_error_sum / num_blocks), max_error);
+    log(LogLevel::INFO, "CaveNoiseBench", "{} cave blocks at full resolution ({}% of all blocks), {}% of the cave blocks of either version are only cave in one",
+        num_caves, (f64)num_caves * 100.0 / (f64)num_blocks, mismatch * 100.0);
+    if (num_caves == 0 || mismatch > max_mismatch) {
+        log(LogLevel::ERROR, "CaveNoiseBench", "More than {}% of the cave blocks moved", max_mismatch * 100.0);
+        return 1;
+    }
+    return 0;
+}
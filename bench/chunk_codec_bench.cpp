@@ -0,0 +1,150 @@
+// Measures chunk payload size and encode/decode throughput of the chunk codec, next to the
+// format it replaced (unpacked u32 indices plus raw light and sunlight maps, LZ4 compressed)
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <lz4.h>
+
+#include "../src/world/chunk_codec.hpp"
+
+static constexpr i32 chunk_size = 16;
+static constexpr uint chunk_volume = chunk_size * chunk_size * chunk_size;
+static constexpr usize num_blocks = 9; // the block ids make_chunk uses
+
+struct TestChunk {
+    std::unique_ptr<BlockStorage> blocks;
+    std::unique_ptr<LightStorage> light;
+    u8 sunlight[chunk_volume / 2] = {};
+};
+
+static u32 hash(i32 x, i32 y, i32 z) {
+    u32 h = (u32)x * 0x8DA6B343u ^ (u32)y * 0xD8163841u ^ (u32)z * 0xCB1AB31Fu;
+    h ^= h >> 15;
+    h *= 0x2C1B3C6Du;
+    return h ^ (h >> 12);
+}
+
+// rolling terrain around y = 0 with stone, dirt, grass, caves lit by a few torches and ores
+// below, and the odd tree above
+static TestChunk make_chunk(i32vec3 chunk_pos) {
+    std::vector<BlockNID> blocks(chunk_volume);
+    std::vector<u16> light(chunk_volume);
+    for (i32 y = 0; y < chunk_size; y++) {
+        for (i32 z = 0; z < chunk_size; z++) {
+            for (i32 x = 0; x < chunk_size; x++) {
+                i32 wx = chunk_pos.x * chunk_size + x, wy = chunk_pos.y * chunk_size + y, wz = chunk_pos.z * chunk_size + z;
+                i32 height = (i32)(6.0 * std::sin(wx * 0.07) + 4.0 * std::cos(wz * 0.05));
+                BlockNID block = 0;
+                if (wy < height - 3) block = 1;       // stone
+                else if (wy < height) block = 2;      // dirt
+                else if (wy == height) block = 3;     // grass
+                else if (wy < height + 6 && hash(wx / 5, 0, wz / 5) % 7 == 0 && wx % 5 == 2 && wz % 5 == 2) block = 4; // trunk
+                if (block == 1 && hash(wx, wy, wz) % 97 == 0) block = 5 + hash(wx, wy, wz) % 4; // ores
+                if (block == 1 && std::sin(wx * 0.2) * std::cos(wy * 0.3) * std::sin(wz * 0.25) > 0.4) block = 0; // caves
+
+                uint index = (y * chunk_size + z) * chunk_size + x;
+                blocks[index] = block;
+                if (block != 0) light[index] = 0;
+                else if (wy > height) light[index] = 0xFFFF;
+                else light[index] = (u16)(std::max(0, 12 - (i32)(hash(wx / 8, wy / 8, wz / 8) % 16)) << 12); // torch light
+            }
+        }
+    }
+
+    TestChunk chunk;
+    chunk.blocks = std::make_unique<BlockStorage>(chunk_volume);
+    chunk.light = std::make_unique<LightStorage>(chunk_volume);
+    chunk.blocks->set_all(blocks.data());
+    chunk.light->set_all(light.data());
+    return chunk;
+}
+
+static std::vector<u8> legacy_encode(TestChunk &chunk) {
+    std::vector<u8> original;
+    auto push = [&] (const void *data, usize size) {
+        original.insert(original.end(), (const u8*)data, (const u8*)data + size);
+    };
+    std::vector<u32> indices(chunk_volume);
+    std::vector<u16> light(chunk_volume);
+    if (!chunk.blocks->is_uniform())
+        PackedArray_unpack(chunk.blocks->m_data.packed, 0, indices.data(), chunk_volume);
+    push(chunk.blocks->m_palette.data(), chunk.blocks->m_palette.size() * sizeof(BlockStorage::PaletteEntry));
+    push(indices.data(), indices.size() * sizeof(u32));
+    chunk.light->get_all(light.data());
+    push(light.data(), light.size() * sizeof(u16));
+    push(chunk.sunlight, sizeof(chunk.sunlight));
+
+    std::vector<u8> compressed(LZ4_compressBound(original.size()));
+    compressed.resize(LZ4_compress_default((const char*)original.data(), (char*)compressed.data(), original.size(), compressed.size()));
+    return compressed;
+}
+
+template<typename F>
+static f64 chunks_per_second(usize num_chunks, F &&function) {
+    usize iterations = 0;
+    auto start = std::chrono::steady_clock::now();
+    std::chrono::duration<f64> elapsed {};
+    while (elapsed.count() < 1.0) {
+        function();
+        iterations++;
+        elapsed = std::chrono::steady_clock::now() - start;
+    }
+    return (f64)(iterations * num_chunks) / elapsed.count();
+}
+
+int main() {
+    // a column of chunks from deep underground up into the sky
+    std::vector<TestChunk> chunks;
+    for (i32 y = -3; y < 2; y++)
+        for (i32 z = 0; z < 4; z++)
+            for (i32 x = 0; x < 4; x++)
+                chunks.push_back(make_chunk(i32vec3(x, y, z)));
+
+    std::vector<std::vector<u8>> payloads;
+    usize codec_bytes = 0, legacy_bytes = 0;
+    for (auto &chunk : chunks) {
+        SerialWriter writer;
+        chunk_codec::encode(writer, *chunk.blocks, *chunk.light, chunk.sunlight);
+        payloads.push_back(writer.take());
+        codec_bytes += payloads.back().size();
+        legacy_bytes += legacy_encode(chunk).size();
+    }
+
+    // check the round trip before timing anything
+    for (usize i = 0; i < chunks.size(); i++) {
+        SerialReader reader(payloads[i]);
+        TestChunk decoded { std::make_unique<BlockStorage>(chunk_volume), std::make_unique<LightStorage>(chunk_volume) };
+        bool valid = chunk_codec::decode(reader, *decoded.blocks, *decoded.light, decoded.sunlight, num_blocks);
+        for (uint j = 0; valid && j < chunk_volume; j++)
+            valid = decoded.blocks->get(j) == chunks[i].blocks->get(j) && decoded.light->get(j) == chunks[i].light->get(j);
+        if (!valid) {
+            log(LogLevel::ERROR, "ChunkCodecBench", "Chunk {} did not survive the round trip", i);
+            return 1;
+        }
+    }
+
+    f64 encode_rate = chunks_per_second(chunks.size(), [&] {
+        for (auto &chunk : chunks) {
+            SerialWriter writer;
+            chunk_codec::encode(writer, *chunk.blocks, *chunk.light, chunk.sunlight);
+        }
+    });
+    TestChunk target { std::make_unique<BlockStorage>(chunk_volume), std::make_unique<LightStorage>(chunk_volume) };
+    f64 decode_rate = chunks_per_second(chunks.size(), [&] {
+        for (auto &payload : payloads) {
+            SerialReader reader(payload);
+            chunk_codec::decode(reader, *target.blocks, *target.light, target.sunlight, num_blocks);
+        }
+    });
+    f64 legacy_encode_rate = chunks_per_second(chunks.size(), [&] {
+        for (auto &chunk : chunks)
+            legacy_encode(chunk);
+    });
+
+    // throughput in terms of the uncompressed chunk: a u32 block and a u16 light value per voxel
+    constexpr f64 mib_per_chunk = (chunk_volume * (sizeof(u32) + sizeof(u16)) + chunk_volume / 2) / 1024.0 / 1024.0;
+    log(LogLevel::INFO, "ChunkCodecBench", "{} chunks, {} bytes per chunk (was {}, {}x smaller)", chunks.size(), codec_bytes / chunks.size(), legacy_bytes / chunks.size(), (f64)legacy_bytes / (f64)codec_bytes);
+    log(LogLevel::INFO, "ChunkCodecBench", "Encode: {} chunks/s ({} MiB/s), previous format {} chunks/s", encode_rate, encode_rate * mib_per_chunk, legacy_encode_rate);
+    log(LogLevel::INFO, "ChunkCodecBench", "Decode: {} chunks/s ({} MiB/s)", decode_rate, decode_rate * mib_per_chunk);
+    return 0;
+}
@@ -0,0 +1,111 @@
+// Measures how chunk map lookups and insertions scale with the number of worker threads,
+// comparing the sharded ChunkMap against the single shared_mutex map it replaced
+#include <thread>
+#include <cstdlib>
+#include <algorithm>
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include <shared_mutex>
+#include <unordered_map>
+
+#include "../src/world/chunk_map.hpp"
+
+// what World used before ChunkMap, every get_or_queue_chunk took the exclusive lock
+class GlobalLockMap {
+    std::unordered_map<i32vec3, Chunk*> m_chunks;
+    std::shared_mutex m_mutex;
+
+public:
+    Chunk* find(i32vec3 chunk_pos) {
+        std::shared_lock guard(m_mutex);
+        auto it = m_chunks.find(chunk_pos);
+        return it != m_chunks.end() ? it->second : nullptr;
+    }
+
+    template<typename F>
+    std::pair<Chunk*, bool> find_or_insert(i32vec3 chunk_pos, F &&create) {
+        std::scoped_lock guard(m_mutex);
+        auto [it, inserted] = m_chunks.try_emplace(chunk_pos, nullptr);
+        if (inserted)
+            it->second = create();
+        return { it->second, inserted };
+    }
+};
+
+static constexpr i32 populated_radius = 16;
+static constexpr i32 queried_radius = 20; // a bit larger so some queries miss and insert
+static constexpr usize ops_per_thread = 1 << 20;
+
+static Chunk* fake_chunk(i32vec3 chunk_pos) {
+    return reinterpret_cast<Chunk*>((uptr)(std::hash<i32vec3>()(chunk_pos) | 1));
+}
+
+struct XorShift {
+    u64 state;
+    u32 next() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return (u32)state;
+    }
+    i32 range(i32 radius) { return (i32)(next() % (2 * radius)) - radius; }
+};
+
+template<typename Map>
+static f64 run(uint num_threads, uint find_percentage) {
+    Map map;
+    for (i32 y = -populated_radius; y < populated_radius; y++)
+        for (i32 z = -populated_radius; z < populated_radius; z++)
+            for (i32 x = -populated_radius; x < populated_radius; x++)
+                map.find_or_insert(i32vec3(x, y, z), [&] { return fake_chunk(i32vec3(x, y, z)); });
+
+    std::atomic_bool go = false;
+    std::atomic<usize> found = 0;
+    std::vector<std::thread> threads;
+    for (uint t = 0; t < num_threads; t++) {
+        threads.emplace_back([&, t] {
+            XorShift rng { 0x9E3779B97F4A7C15ull * (t + 1) };
+            usize local_found = 0;
+            while (!go.load(std::memory_order_acquire));
+            for (usize i = 0; i < ops_per_thread; i++) {
+                i32vec3 chunk_pos(rng.range(queried_radius), rng.range(queried_radius), rng.range(queried_radius));
+                if (rng.next() % 100 < find_percentage)
+                    local_found += map.find(chunk_pos) != nullptr;
+                else
+                    local_found += map.find_or_insert(chunk_pos, [&] { return fake_chunk(chunk_pos); }).second;
+            }
+            found += local_found;
+        });
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    go.store(true, std::memory_order_release);
+    for (auto &thread : threads)
+        thread.join();
+    auto stop = std::chrono::steady_clock::now();
+
+    f64 seconds = std::chrono::duration<f64>(stop - start).count();
+    return (f64)(num_threads * ops_per_thread) / seconds / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    uint max_threads = std::max(1u, std::thread::hardware_concurrency());
+    if (argc > 1)
+        max_threads = std::max(1, std::atoi(argv[1]));
+
+    std::vector<uint> thread_counts;
+    for (uint num_threads = 1; num_threads < max_threads; num_threads *= 2)
+        thread_counts.push_back(num_threads);
+    thread_counts.push_back(max_threads);
+
+    for (uint find_percentage : { 0u, 90u }) {
+        log(LogLevel::INFO, "ChunkMapBench", "{}% find, {}% find_or_insert, {} ops per thread", find_percentage, 100 - find_percentage, ops_per_thread);
+        for (uint num_threads : thread_counts) {
+            f64 global = run<GlobalLockMap>(num_threads, find_percentage);
+            f64 sharded = run<ChunkMap>(num_threads, find_percentage);
+            log(LogLevel::INFO, "ChunkMapBench", "{} threads: global lock {} Mops/s, sharded {} Mops/s ({}x)", num_threads, global, sharded, sharded / global);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,164 @@
+// Meshes canned scenes with ChunkMeshBuilder, without a window or a world: ordinary terrain,
+// caves, glass and water, foliage, and a checkerboard that gives the most faces possible.
+// Reports faces/s, chunks/s and how many heap allocations meshing makes.
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <vector>
+#include <functional>
+
+#include "../src/world/chunk.hpp"
+#include "../src/renderer/chunk_renderer.hpp"
+
+static std::atomic<usize> num_allocations = 0;
+
+void* operator new(usize size) {
+    num_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *ptr = std::malloc(size))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, usize) noexcept {
+    std::free(ptr);
+}
+
+// the scene spans region_size^3 chunks, everything but the outer shell gets meshed
+static constexpr i32 region_size = 5;
+
+// block ids in the order register_blocks adds them
+enum : BlockNID {
+    VOID = 0, STONE = 1, DIRT = 3, GRASS_BLOCK = 4, WOOD_LOG = 6, SAND = 7, GLASS = 8,
+    WATER = 10, GRASS = 11, LEAVES = 12, DANDELION = 13, ROSE = 14,
+};
+
+static u32 hash(i32 x, i32 y, i32 z) {
+    u32 h = (u32)x * 0x8DA6B343u ^ (u32)y * 0xD8163841u ^ (u32)z * 0xCB1AB31Fu;
+    h ^= h >> 15;
+    h *= 0x2C1B3C6Du;
+    return h ^ (h >> 12);
+}
+
+static i32 terrain_height(i32 x, i32 z) {
+    return (i32)(6.0 * std::sin(x * 0.07) + 4.0 * std::cos(z * 0.05));
+}
+
+struct Scenario {
+    const char *name;
+    std::function<BlockNID(i32, i32, i32)> block_at; // in blocks, the region is centered on 0
+};
+
+static const Scenario scenarios[] = {
+    { "terrain", [] (i32 x, i32 y, i32 z) -> BlockNID {
+        i32 height = terrain_height(x, z);
+        if (y < height - 3) return STONE;
+        if (y < height) return DIRT;
+        if (y == height) return GRASS_BLOCK;
+        return VOID;
+    } },
+    { "caves", [] (i32 x, i32 y, i32 z) -> BlockNID {
+        if (std::sin(x * 0.2) * std::cos(y * 0.3) * std::sin(z * 0.25) > 0.2)
+            return VOID;
+        return STONE;
+    } },
+    { "glass and water", [] (i32 x, i32 y, i32 z) -> BlockNID {
+        i32 height = terrain_height(x, z) - 8;
+        if (y < height) return SAND;
+        if (x % 6 == 0 || z % 6 == 0) return y < 12 ? GLASS : VOID;
+        return y <= 0 ? WATER : VOID;
+    } },
+    { "foliage", [] (i32 x, i32 y, i32 z) -> BlockNID {
+        i32 height = terrain_height(x, z);
+        if (y < height) return DIRT;
+        if (y == height) return GRASS_BLOCK;
+        if (y == height + 1) {
+            u32 roll = hash(x, 0, z) % 8;
+            return roll == 0 ? DANDELION : roll == 1 ? ROSE : GRASS;
+        }
+        // tree crowns on a grid of trunks
+        i32 tx = x - ((x % 8) + 8) % 8 + 4, tz = z - ((z % 8) + 8) % 8 + 4;
+        i32 crown_y = terrain_height(tx, tz) + 6;
+        if (x == tx && z == tz && y < crown_y) return WOOD_LOG;
+        i32 dx = x - tx, dy = y - crown_y, dz = z - tz;
+        if (dx * dx + dy * dy + dz * dz <= 9) return LEAVES;
+        return VOID;
+    } },
+    { "checkerboard", [] (i32 x, i32 y, i32 z) -> BlockNID {
+        return ((x + y + z) & 1) ? STONE : VOID;
+    } },
+};
+
+int main() {
+    register_blocks();
+
+    for (auto &scenario : scenarios) {
+        std::vector<std::unique_ptr<Chunk>> chunks(region_size * region_size * region_size);
+        auto chunk_at = [&] (i32vec3 pos) {
+            return chunks[(pos.y * region_size + pos.z) * region_size + pos.x].get();
+        };
+        std::vector<BlockNID> blocks(Chunk::volume);
+        for (i32 cy = 0; cy < region_size; cy++) {
+            for (i32 cz = 0; cz < region_size; cz++) {
+                for (i32 cx = 0; cx < region_size; cx++) {
+                    i32vec3 chunk_pos = i32vec3(cx, cy, cz) - region_size / 2;
+                    for (i32 y = 0; y < Chunk::size; y++)
+                        for (i32 z = 0; z < Chunk::size; z++)
+                            for (i32 x = 0; x < Chunk::size; x++)
+                                blocks[coords_to_index<Chunk::size>(x, y, z)] = scenario.block_at(chunk_pos.x * Chunk::size + x, chunk_pos.y * Chunk::size + y, chunk_pos.z * Chunk::size + z);
+                    auto &chunk = chunks[(cy * region_size + cz) * region_size + cx];
+                    chunk = std::make_unique<Chunk>(chunk_pos);
+                    chunk->set_blocks(blocks.data());
+                    chunk->m_decorated.test_and_set();
+                }
+            }
+        }
+
+        std::vector<renderer::ChunkNeighborhood> neighborhoods;
+        for (i32 cy = 1; cy < region_size - 1; cy++) {
+            for (i32 cz = 1; cz < region_size - 1; cz++) {
+                for (i32 cx = 1; cx < region_size - 1; cx++) {
+                    auto &neighborhood = neighborhoods.emplace_back();
+                    for (i32 y = -1; y < 2; y++)
+                        for (i32 z = -1; z < 2; z++)
+                            for (i32 x = -1; x < 2; x++)
+                                neighborhood.chunks[coords_to_index<3>(x + 1, y + 1, z + 1)] = chunk_at(i32vec3(cx + x, cy + y, cz + z));
+                }
+            }
+        }
+
+        // a fresh builder like the renderer hands out, the first pass grows its buffers
+        renderer::ChunkMeshBuilder builder;
+        usize allocations_before = num_allocations.load();
+        usize num_faces = 0;
+        for (auto &neighborhood : neighborhoods) {
+            builder.build(neighborhood);
+            num_faces += builder.m_faces.size() + builder.m_transparent_indices.size() / 6;
+        }
+        usize first_pass_allocations = num_allocations.load() - allocations_before;
+
+        usize iterations = 0;
+        allocations_before = num_allocations.load();
+        auto start = std::chrono::steady_clock::now();
+        std::chrono::duration<f64> elapsed {};
+        while (elapsed.count() < 1.0) {
+            for (auto &neighborhood : neighborhoods)
+                builder.build(neighborhood);
+            iterations++;
+            elapsed = std::chrono::steady_clock::now() - start;
+        }
+        usize steady_allocations = num_allocations.load() - allocations_before;
+
+        f64 chunks_per_second = (f64)(iterations * neighborhoods.size()) / elapsed.count();
+        f64 faces_per_second = (f64)(iterations * num_faces) / elapsed.count();
+        log(LogLevel::INFO, "ChunkMeshBench", "{}: {} faces per chunk, {} chunks/s, {} faces/s, {} allocations in the first pass, {} per chunk after",
+            scenario.name, num_faces / neighborhoods.size(), chunks_per_second, faces_per_second, first_pass_allocations,
+            (f64)steady_allocations / (f64)(iterations * neighborhoods.size()));
+    }
+    return 0;
+}
@@ -0,0 +1,78 @@
+// Checks that the heightmap upsampling kernel matches the per-cell loop it replaced bit for bit,
+// and compares how fast the two are
+#include <chrono>
+#include <vector>
+#include <cstring>
+
+#include "../src/world/noise_upsample.hpp"
+
+static constexpr i32 size = 16;
+static constexpr i32 factor = 2;
+static constexpr i32 coarse_size = noise_upsample::coarse_size<size, factor>;
+
+// what World::generate_noise used to do
+static void reference(const f32 *noise_output, i32 noise_stride, f32 *out) {
+    for (i32 z = 0; z < size; z++) {
+        for (i32 x = 0; x < size; x++) {
+            f32 value = 0;
+            if (x % 2 == 0 && z % 2 == 0) {
+                value = noise_output[(z / 2) * noise_stride + x / 2];
+            } else if (x % 2 == 0 && z % 2 != 0) {
+                value = (noise_output[(z / 2) * noise_stride + x / 2] + noise_output[(z / 2 + 1) * noise_stride + x / 2]) / 2.0f;
+            } else if (x % 2 != 0 && z % 2 == 0) {
+                value = (noise_output[(z / 2) * noise_stride + x / 2] + noise_output[(z / 2) * noise_stride + x / 2 + 1]) / 2.0f;
+            } else {
+                f32 value1 = (noise_output[(z / 2) * noise_stride + x / 2] + noise_output[(z / 2) * noise_stride + x / 2 + 1]) / 2.0f;
+                f32 value2 = (noise_output[(z / 2 + 1) * noise_stride + x / 2] + noise_output[(z / 2 + 1) * noise_stride + x / 2 + 1]) / 2.0f;
+                value = (value1 + value2) / 2.0f;
+            }
+            out[z * size + x] = value;
+        }
+    }
+}
+
+int main() {
+    // noise-like values in [-1, 1], with a stride wider than one grid like a tile of columns
+    constexpr i32 stride = 4 * (coarse_size - 1) + 1;
+    constexpr i32 num_grids = 1024;
+    std::vector<f32> coarse(num_grids * coarse_size * stride);
+    u32 state = 1;
+    for (f32 &value : coarse) {
+        state = state * 1664525u + 1013904223u;
+        value = (f32)(state >> 8) / (f32)(1 << 23) - 1.0f;
+    }
+
+    std::vector<f32> expected(size * size), actual(size * size);
+    for (i32 grid = 0; grid < num_grids; grid++) {
+        const f32 *in = &coarse[grid * coarse_size * stride];
+        reference(in, stride, expected.data());
+        noise_upsample::bilinear<size, factor>(in, stride, actual.data());
+        if (std::memcmp(expected.data(), actual.data(), expected.size() * sizeof(f32)) != 0) {
+            log(LogLevel::ERROR, "HeightmapUpsampleBench", "Grid {} differs from the reference", grid);
+            return 1;
+        }
+    }
+
+    auto grids_per_second = [&] (auto &&function) {
+        usize iterations = 0;
+        auto start = std::chrono::steady_clock::now();
+        std::chrono::duration<f64> elapsed {};
+        while (elapsed.count() < 1.0) {
+            for (i32 grid = 0; grid < num_grids; grid++)
+                function(&coarse[grid * coarse_size * stride]);
+            iterations++;
+            elapsed = std::chrono::steady_clock::now() - start;
+        }
+        return (f64)(iterations * num_grids) / elapsed.count();
+    };
+    f64 reference_rate = grids_per_second([&] (const f32 *in) {
+        reference(in, stride, expected.data());
+    });
+    f64 kernel_rate = grids_per_second([&] (const f32 *in) {
+        noise_upsample::bilinear<size, factor>(in, stride, actual.data());
+    });
+
+    log(LogLevel::INFO, "HeightmapUpsampleBench", "{} grids identical to the reference", num_grids);
+    log(LogLevel::INFO, "HeightmapUpsampleBench", "Reference: {} columns/s, kernel: {} columns/s ({}x)", reference_rate, kernel_rate, kernel_rate / reference_rate);
+    return 0;
+}
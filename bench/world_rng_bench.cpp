@@ -0,0 +1,50 @@
+// Compares the speed of the generation RNG, rolled one at a time and in batches, with the
+// std::hash rolls it replaced. What it rolls is pinned by the worldgen golden test.
+#include <chrono>
+#include <vector>
+#include <functional>
+#define GLM_ENABLE_EXPERIMENTAL
+#include <glm/gtx/hash.hpp>
+
+#include "../src/world/world_rng.hpp"
+
+static constexpr u32 seed = 1337;
+
+int main() {
+    // the rolls for one column of surface blocks, like World::decorate_column makes them
+    constexpr usize count = 256;
+    std::vector<i32> xs(count), ys(count), zs(count);
+    std::vector<i32vec3> positions(count);
+    std::vector<u32> rolls(count);
+    for (usize i = 0; i < count; i++) {
+        xs[i] = (i32)(i % 16);
+        ys[i] = (i32)(i * 7 % 23);
+        zs[i] = (i32)(i / 16);
+        positions[i] = i32vec3(xs[i], ys[i], zs[i]);
+    }
+    auto rolls_per_second = [&] (auto &&function) {
+        usize iterations = 0;
+        auto start = std::chrono::steady_clock::now();
+        std::chrono::duration<f64> elapsed {};
+        while (elapsed.count() < 1.0) {
+            function();
+            iterations++;
+            elapsed = std::chrono::steady_clock::now() - start;
+        }
+        return (f64)(iterations * count) / elapsed.count();
+    };
+    f64 std_hash_rate = rolls_per_second([&] {
+        for (usize i = 0; i < count; i++)
+            rolls[i] = std::hash<i32vec4>()(i32vec4(xs[i], ys[i], zs[i], seed)) % 100;
+    });
+    f64 philox_rate = rolls_per_second([&] {
+        for (usize i = 0; i < count; i++)
+            rolls[i] = world_rng::roll(seed, i32vec3(xs[i], ys[i], zs[i]), world_rng::Feature::DECORATION, 100);
+    });
+    f64 batch_rate = rolls_per_second([&] {
+        world_rng::roll_batch(seed, positions.data(), world_rng::Feature::DECORATION, 100, rolls.data(), count);
+    });
+
+    log(LogLevel::INFO, "WorldRngBench", "std::hash: {} rolls/s, Philox: {} rolls/s, Philox batched: {} rolls/s", std_hash_rate, philox_rate, batch_rate);
+    return 0;
+}
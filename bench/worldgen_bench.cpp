@@ -0,0 +1,101 @@
+// Generates a fixed block of chunks through shape_chunk and decorate_chunk on 1 to N threads,
+// without a window. Reports chunks/s and per-stage latency percentiles, and a hash of everything
+// generated that has to come out the same on every thread count.
+//
+//   worldgen_bench [max threads]
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <filesystem>
+
+#include "../src/world/world.hpp"
+
+static constexpr i32 horizontal_radius = 12;
+static constexpr i32 min_y = -6, max_y = 6;
+
+static u64 hash_blocks(const BlockNID *blocks) {
+    u64 hash = 0xCBF29CE484222325ull;
+    for (uint i = 0; i < Chunk::volume; i++)
+        hash = (hash ^ blocks[i]) * 0x100000001B3ull;
+    return hash;
+}
+
+static f64 percentile(std::vector<f64> &values, f64 fraction) {
+    usize index = std::min((usize)(fraction * values.size()), values.size() - 1);
+    std::nth_element(values.begin(), values.begin() + index, values.end());
+    return values[index];
+}
+
+int main(int argc, char **argv) {
+    uint max_threads = argc > 1 ? std::stoul(argv[1]) : std::max(std::thread::hardware_concurrency(), 1u);
+
+    std::vector<i32vec3> chunks;
+    for (i32 y = min_y; y < max_y; y++)
+        for (i32 z = -horizontal_radius; z < horizontal_radius; z++)
+            for (i32 x = -horizontal_radius; x < horizontal_radius; x++)
+                chunks.emplace_back(x, y, z);
+
+    // nothing gets saved, but the world's chunk store still wants a directory of its own
+    auto scratch_directory = std::filesystem::temp_directory_path() / "voksel_worldgen_bench";
+    u64 first_hash = 0;
+    for (uint num_threads = 1; num_threads <= max_threads; num_threads++) {
+        // a fresh world each time, so every run generates its columns too
+        auto world = std::make_unique<World>(scratch_directory);
+        std::vector<u64> chunk_hashes(chunks.size());
+        std::vector<std::vector<f64>> shape_times(num_threads), decorate_times(num_threads);
+        std::atomic<usize> next_chunk = 0;
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> threads;
+        for (uint thread = 0; thread < num_threads; thread++) {
+            threads.emplace_back([&, thread] {
+                std::vector<BlockNID> blocks(Chunk::volume);
+                for (usize i = next_chunk++; i < chunks.size(); i = next_chunk++) {
+                    std::fill(blocks.begin(), blocks.end(), 0);
+                    BlockNID uniform_block;
+                    auto shape_start = std::chrono::steady_clock::now();
+                    bool uniform = world->shape_chunk(chunks[i], blocks.data(), uniform_block);
+                    auto shape_end = std::chrono::steady_clock::now();
+                    if (uniform)
+                        std::fill(blocks.begin(), blocks.end(), uniform_block);
+                    else
+                        world->decorate_chunk(chunks[i], blocks.data());
+                    auto decorate_end = std::chrono::steady_clock::now();
+
+                    shape_times[thread].push_back(std::chrono::duration<f64, std::micro>(shape_end - shape_start).count());
+                    if (!uniform)
+                        decorate_times[thread].push_back(std::chrono::duration<f64, std::micro>(decorate_end - shape_end).count());
+                    chunk_hashes[i] = hash_blocks(blocks.data());
+                }
+            });
+        }
+        for (auto &thread : threads)
+            thread.join();
+        f64 seconds = std::chrono::duration<f64>(std::chrono::steady_clock::now() - start).count();
+
+        u64 hash = 0;
+        for (u64 chunk_hash : chunk_hashes)
+            hash = hash * 31 + chunk_hash;
+        std::vector<f64> shape, decorate;
+        for (uint thread = 0; thread < num_threads; thread++) {
+            shape.insert(shape.end(), shape_times[thread].begin(), shape_times[thread].end());
+            decorate.insert(decorate.end(), decorate_times[thread].begin(), decorate_times[thread].end());
+        }
+
+        world.reset();
+        log(LogLevel::INFO, "WorldgenBench", "{} threads: {} chunks/s, shape p50 {} us p99 {} us, decorate p50 {} us p99 {} us ({} chunks), hash {}",
+            num_threads, (f64)chunks.size() / seconds, percentile(shape, 0.5), percentile(shape, 0.99),
+            decorate.empty() ? 0.0 : percentile(decorate, 0.5), decorate.empty() ? 0.0 : percentile(decorate, 0.99), decorate.size(), hash);
+        if (num_threads == 1) {
+            first_hash = hash;
+        } else if (hash != first_hash) {
+            log(LogLevel::ERROR, "WorldgenBench", "{} threads generated different chunks than 1 thread", num_threads);
+            std::filesystem::remove_all(scratch_directory);
+            return 1;
+        }
+    }
+    std::filesystem::remove_all(scratch_directory);
+    return 0;
+}
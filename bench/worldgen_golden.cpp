@@ -0,0 +1,213 @@
+// Pins what generation gives for seed 1337, so a change that would alter worlds made from a seed
+// fails here: Philox against its reference vectors, raw rolls in single and batched form, and
+// the decoration and structures of a block of columns with made up heights.
+//
+// Called with a golden file it checks the blocks shape_chunk and decorate_chunk produce for a
+// patch of chunks instead, terrain noise included. Those hashes come from FastNoise, whose output
+// can differ in the last bits between the instruction sets it runs with, so they are recorded
+// with --record on the reference machine and updated along with generator_version. Without
+// recorded hashes that check reports itself skipped.
+#include <fstream>
+#include <cstring>
+#include <filesystem>
+#include <stdlib.h>
+
+#include "../src/world/world.hpp"
+
+static constexpr u32 seed = 1337;
+// FNV-1a hashes, update only together with generator_version
+static constexpr u64 pinned_rolls_hash = 8761699465509719272ull;
+static constexpr u64 pinned_columns_hash = 16177193362769843147ull;
+
+static bool check_reference_vectors() {
+    struct Vector {
+        world_rng::Block counter;
+        u32 key0, key1;
+        world_rng::Block expected;
+    };
+    // from the Random123 known answer tests
+    const Vector vectors[] = {
+        { { { 0, 0, 0, 0 } }, 0, 0, { { 0x6627E8D5u, 0xE169C58Du, 0xBC57AC4Cu, 0x9B00DBD8u } } },
+        { { { ~0u, ~0u, ~0u, ~0u } }, ~0u, ~0u, { { 0x408F276Du, 0x41C83B0Eu, 0xA20BC7C6u, 0x6D5451FDu } } },
+        { { { 0x243F6A88u, 0x85A308D3u, 0x13198A2Eu, 0x03707344u } }, 0xA4093822u, 0x299F31D0u, { { 0xD16CFE09u, 0x94FDCCEBu, 0x5001E420u, 0x24126EA1u } } },
+    };
+    for (auto &vector : vectors) {
+        auto result = world_rng::philox(vector.counter, vector.key0, vector.key1);
+        for (i32 i = 0; i < 4; i++)
+            if (result.v[i] != vector.expected.v[i])
+                return false;
+    }
+    return true;
+}
+
+static void mix(u64 &hash, i64 value) {
+    hash = (hash ^ (u64)value) * 0x100000001B3ull;
+}
+
+static u64 pinned_rolls() {
+    u64 hash = 0xCBF29CE484222325ull;
+    for (i32 feature = 0; feature <= (i32)world_rng::Feature::TREE_LEAF; feature++)
+        for (i32 y = -4; y <= 4; y++)
+            for (i32 z = -64; z < 64; z++)
+                for (i32 x = -64; x < 64; x++)
+                    mix(hash, world_rng::roll(seed, i32vec3(x, y * 37, z), (world_rng::Feature)feature, 100));
+    return hash;
+}
+
+// the batched rolls have to give the same bits, including for the odd positions after the last full batch
+static bool check_batched_rolls() {
+    std::vector<i32vec3> positions;
+    for (i32 z = -20; z < 20; z++)
+        for (i32 x = -20; x < 21; x++)
+            positions.emplace_back(x * 977, (x ^ z) - 3, z * -131);
+    std::vector<u32> rolls(positions.size());
+    for (u32 n : { 1u, 100u, ~0u }) {
+        for (i32 feature = 0; feature <= (i32)world_rng::Feature::TREE_LEAF; feature++) {
+            world_rng::roll_batch(seed, positions.data(), (world_rng::Feature)feature, n, rolls.data(), positions.size());
+            for (usize i = 0; i < positions.size(); i++)
+                if (rolls[i] != world_rng::roll(seed, positions[i], (world_rng::Feature)feature, n))
+                    return false;
+        }
+    }
+    return true;
+}
+
+static u64 pinned_columns(World &world, usize &num_structures) {
+    u64 hash = 0xCBF29CE484222325ull;
+    num_structures = 0;
+    for (i32 column_z = -8; column_z < 8; column_z++) {
+        for (i32 column_x = -8; column_x < 8; column_x++) {
+            ColumnCache::Column column {};
+            for (i32 i = 0; i < Chunk::area; i++) {
+                i32 x = column_x * Chunk::size + i % Chunk::size, z = column_z * Chunk::size + i / Chunk::size;
+                column.heights[i] = (x * 7 + z * 13) % 40 - 4; // sometimes too low for trees
+            }
+            world.decorate_column(i32vec2(column_x, column_z), column);
+
+            for (u8 decoration : column.decoration)
+                mix(hash, decoration);
+            for (auto &structure : column.structures) {
+                mix(hash, (i64)structure.type);
+                for (i32vec3 pos : { structure.origin, structure.min, structure.max })
+                    for (i32 i = 0; i < 3; i++)
+                        mix(hash, pos[i]);
+            }
+            num_structures += column.structures.size();
+        }
+    }
+    return hash;
+}
+
+static int check_generation(World &world) {
+    if (!check_reference_vectors()) {
+        log(LogLevel::ERROR, "WorldgenGolden", "Philox doesn't match the reference vectors");
+        return 1;
+    }
+    u64 rolls_hash = pinned_rolls();
+    if (rolls_hash != pinned_rolls_hash) {
+        log(LogLevel::ERROR, "WorldgenGolden", "Rolls for seed {} changed, hash {} instead of {}", seed, rolls_hash, pinned_rolls_hash);
+        return 1;
+    }
+    if (!check_batched_rolls()) {
+        log(LogLevel::ERROR, "WorldgenGolden", "Batched rolls differ from single ones");
+        return 1;
+    }
+
+    usize num_structures;
+    u64 columns_hash = pinned_columns(world, num_structures);
+    if (columns_hash != pinned_columns_hash) {
+        log(LogLevel::ERROR, "WorldgenGolden", "Columns for seed {} changed, hash {} instead of {}", seed, columns_hash, pinned_columns_hash);
+        return 1;
+    }
+
+    log(LogLevel::INFO, "WorldgenGolden", "Reference vectors, rolls and {} structures match", num_structures);
+    return 0;
+}
+
+// the generated blocks of a chunk, shaped and decorated the way generate_baseline does it
+static u64 terrain_hash(World &world, i32vec3 chunk_pos) {
+    static std::array<BlockNID, Chunk::volume> blocks;
+    blocks.fill(0);
+    BlockNID uniform_block;
+    if (world.shape_chunk(chunk_pos, blocks.data(), uniform_block))
+        blocks.fill(uniform_block);
+    else
+        world.decorate_chunk(chunk_pos, blocks.data());
+    u64 hash = 0xCBF29CE484222325ull;
+    for (BlockNID block : blocks)
+        mix(hash, block);
+    return hash;
+}
+
+// from deep in the caves up past the trees, over a few columns either side of the origin
+static std::vector<i32vec3> terrain_chunks() {
+    std::vector<i32vec3> chunks;
+    for (i32 y = -6; y < 4; y++)
+        for (i32 z = -3; z < 3; z++)
+            for (i32 x = -3; x < 3; x++)
+                chunks.emplace_back(x, y, z);
+    return chunks;
+}
+
+// returns 0 if the terrain matches, 1 if it doesn't, and 77 (skipped) if nothing is recorded yet
+static int check_terrain(World &world, const std::filesystem::path &golden_path, bool record) {
+    auto chunks = terrain_chunks();
+    if (record) {
+        std::ofstream output(golden_path);
+        output << "# chunk x y z and the FNV-1a hash of its generated blocks, written by worldgen_golden --record\n";
+        for (i32vec3 chunk_pos : chunks)
+            output << chunk_pos.x << ' ' << chunk_pos.y << ' ' << chunk_pos.z << ' ' << terrain_hash(world, chunk_pos) << '\n';
+        log(LogLevel::INFO, "WorldgenGolden", "Recorded the terrain of {} chunks in {}", chunks.size(), golden_path);
+        return output ? 0 : 1;
+    }
+
+    std::ifstream input(golden_path);
+    std::string line;
+    usize num_checked = 0, num_mismatched = 0;
+    while (std::getline(input, line)) {
+        if (line.empty() || line[0] == '#')
+            continue;
+        i32vec3 chunk_pos;
+        unsigned long long pinned;
+        if (std::sscanf(line.c_str(), "%d %d %d %llu", &chunk_pos.x, &chunk_pos.y, &chunk_pos.z, &pinned) != 4) {
+            log(LogLevel::ERROR, "WorldgenGolden", "Can't read {} in {}", line, golden_path);
+            return 1;
+        }
+        u64 hash = terrain_hash(world, chunk_pos);
+        if (hash != pinned) {
+            log(LogLevel::ERROR, "WorldgenGolden", "Terrain of chunk {} changed, hash {} instead of {}", chunk_pos, hash, (u64)pinned);
+            num_mismatched++;
+        }
+        num_checked++;
+    }
+    if (num_checked == 0) {
+        log(LogLevel::WARN, "WorldgenGolden", "No terrain recorded in {}, run worldgen_golden {} --record on a reference build", golden_path, golden_path);
+        return 77;
+    }
+    if (num_mismatched != 0)
+        return 1;
+    log(LogLevel::INFO, "WorldgenGolden", "Terrain of {} chunks matches", num_checked);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    // nothing gets saved, but the world's chunk store still wants a directory of its own, and
+    // another run of this at the same time mustn't share it
+    std::string scratch_template = (std::filesystem::temp_directory_path() / "voksel_worldgen_golden_XXXXXX").string();
+    if (!mkdtemp(scratch_template.data())) {
+        log(LogLevel::ERROR, "WorldgenGolden", "Failed to create a scratch directory in {}", std::filesystem::temp_directory_path());
+        return 1;
+    }
+    std::filesystem::path scratch_directory = scratch_template;
+
+    int result;
+    {
+        World world(scratch_directory);
+        if (argc > 1)
+            result = check_terrain(world, argv[1], argc > 2 && std::strcmp(argv[2], "--record") == 0);
+        else
+            result = check_generation(world);
+    }
+    std::filesystem::remove_all(scratch_directory);
+    return result;
+}
@@ -35,6 +35,9 @@ BlockData* get_block_data(BlockNID nid) {
 usize num_block_data() { return block_data_registry.size(); }
 
 static u32 load_block_texture(const std::string &name) {
+    // headless, nothing gets drawn
+    if (!entt::locator<renderer::TextureManager>::has_value())
+        return 0;
     return entt::locator<renderer::TextureManager>::value().load_texture(name);
 }
 
@@ -7,6 +7,7 @@
 #include "renderer/texture.hpp"
 #include "renderer/imgui_impl_voksel.hpp"
 #include "player.hpp"
+#include "world/storage_dedup.hpp"
 
 #include <chrono>
 #include <GLFW/glfw3.h>
@@ -152,11 +153,11 @@ void Game::heartbeat() {
 
 void Game::tick() {
     if (m_in_game) {
-        m_world->shape_chunks();
-        m_world->decorate_chunks();
+        m_world->generate_chunks();
         m_world->apply_changes();
         m_world->mesh_chunks();
         m_world->check_chunks();
+        m_world->save_chunks();
 
         {
             std::scoped_lock guard(movement_velocity_mutex);
@@ -231,12 +232,20 @@ void Game::render() {
             ImGui::Text("Chunk position: %d, %d, %d", chunk_pos.x, chunk_pos.y, chunk_pos.z);
             ImGui::Text("Chunk offset: %d, %d, %d", chunk_offset.x, chunk_offset.y, chunk_offset.z);
             ImGui::Text("Position: %f, %f, %f", m_camera->pos().x, m_camera->pos().y, m_camera->pos().z);
+            auto chunk_memory = chunk_allocator::stats();
+            ImGui::Text("Chunk memory: %.1f MiB live, %.1f MiB peak, %.1f MiB reserved", (f64)chunk_memory.live_bytes / 1024.0 / 1024.0, (f64)chunk_memory.peak_bytes / 1024.0 / 1024.0, (f64)chunk_memory.reserved_bytes / 1024.0 / 1024.0);
+            auto dedup = storage_dedup::stats();
+            ImGui::Text("Storage dedup: %zu storages in %zu payloads (%.1fx)", dedup.references, dedup.payloads, dedup.payloads ? (f64)dedup.references / (f64)dedup.payloads : 1.0);
 
             if (show_utilities_window) {
                 ImGui::Begin("Utilities", &show_utilities_window);
                 ImGui::Checkbox("Unlock block modification", &unlock_block_modification);
                 ImGui::SetNextItemWidth(ImGui::GetWindowWidth() * 0.5f);
                 ImGui::SliderFloat("Gravity", &gravitational_acceleration, -16, 32);
+                i32 memory_budget = m_world->memory_budget() / 1024 / 1024;
+                ImGui::SetNextItemWidth(ImGui::GetWindowWidth() * 0.5f);
+                if (ImGui::SliderInt("Chunk memory budget (MiB)", &memory_budget, 64, 8192))
+                    m_world->set_memory_budget((usize)memory_budget * 1024 * 1024);
                 static i32 coords[3] = {};
                 ImGui::SetNextItemWidth(ImGui::GetWindowWidth() * 0.5f);
                 ImGui::InputInt3("Coordinates", coords);
@@ -1,6 +1,7 @@
 #include "game.hpp"
 
 #include <cstring>
+#include <cstdlib>
 #include <entt/entt.hpp>
 
 int main(int argc, char *argv[]) {
@@ -18,6 +19,7 @@ int main(int argc, char *argv[]) {
             log(LogLevel::INFO, "main", "  singleplayer             Directly enters a new singleplayer world");
             log(LogLevel::INFO, "main", "  server                   Hosts a server");
             log(LogLevel::INFO, "main", "  connect 127.0.0.1:12345  Connects to a server");
+            log(LogLevel::INFO, "main", "  pregen 16                Generates and saves every chunk within 16 chunks of spawn, without a window");
             return 0;
         } else if (std::strcmp(argv[1], "singleplayer") == 0) {
             auto *game = new Game(true);
@@ -38,6 +40,17 @@ int main(int argc, char *argv[]) {
         if (std::strcmp(argv[1], "connect") == 0) {
             log(LogLevel::INFO, "main", "connecting to {}", argv[2]);
             return 0;
+        } else if (std::strcmp(argv[1], "pregen") == 0) {
+            i32 radius = std::atoi(argv[2]);
+            if (radius <= 0) {
+                log(LogLevel::ERROR, "main", "Invalid radius {}", argv[2]);
+                return 1;
+            }
+            register_blocks();
+            auto *world = new World();
+            world->pregenerate(radius);
+            delete world; // waits for everything to be written
+            return 0;
         }
     }
 
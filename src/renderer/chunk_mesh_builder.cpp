@@ -1,6 +1,5 @@
 #include "chunk_mesh_builder.hpp"
 #include "chunk_renderer.hpp"
-#include "../game.hpp"
 #include "src/block/block.hpp"
 #include "src/world/chunk.hpp"
 
@@ -19,29 +18,13 @@ namespace renderer {
     }
 
 std::mutex pritn_mutex;
-#define NC(x, y, z) neighbor_chunks[coords_to_index<3>(x, y, z)]
+#define NC(x, y, z) neighborhood.chunks[coords_to_index<3>(x, y, z)]
 #define NB(x, y, z) neighbor_blocks[coords_to_index<3>(x, y, z)]
 #define NL(x, y, z) neighbor_light[coords_to_index<3>(x, y, z)]
-    bool ChunkMeshBuilder::build(Chunk *chunk) {
-        auto world = Game::get()->world();
+    void ChunkMeshBuilder::build(const ChunkNeighborhood &neighborhood) {
+        Chunk *chunk = neighborhood.center();
         m_chunk = chunk;
 
-        Chunk *neighbor_chunks[3 * 3 * 3];
-        bool missing_chunk = false;
-        for (i32 y = -1; y < 2; y++) {
-            for (i32 z = -1; z < 2; z++) {
-                for (i32 x = -1; x < 2; x++) {
-                    auto current_chunk = world->get_or_queue_chunk(chunk->m_chunk_pos + i32vec3(x, y, z));
-                    if (!current_chunk || !current_chunk->m_decorated.test())
-                        missing_chunk = true;
-                    NC(x + 1, y + 1, z + 1) = current_chunk;
-                }
-            }
-        }
-
-        if (missing_chunk)
-            return false;
-
         BlockNID neighbor_blocks[3 * 3 * 3];
         u16 neighbor_light[3 * 3 * 3];
 
@@ -50,14 +33,14 @@ std::mutex pritn_mutex;
         m_last_transparent_index = -1;
         m_faces.clear();
 
-        if (chunk->m_storage.m_bits_per_index == 0 && chunk->m_storage.m_data.single->type == 0)
-            return true; // the chunk is just void
+        if (chunk->m_storage->is_uniform() && chunk->m_storage->uniform_value() == 0)
+            return; // the chunk is just void
 
-        // FIXME: handle the case where the single type isnt void
-        u32 unpacked[Chunk::volume];
-        PackedArray_unpack(chunk->m_storage.m_data.packed, 0, unpacked, Chunk::volume);
-        for (usize i = 0; i < Chunk::volume; i++)
-            unpacked[i] = chunk->m_storage.m_palette[unpacked[i]].type;
+        BlockNID unpacked[Chunk::volume];
+        u16 unpacked_light[Chunk::volume];
+        // meshing runs in a pass of its own, nothing writes the chunks while they get read
+        chunk->get_blocks(unpacked);
+        chunk->get_light(unpacked_light);
 
         for (uint y = 0; y < Chunk::size; y++) {
             for (uint z = 0; z < Chunk::size; z++) {
@@ -81,13 +64,13 @@ std::mutex pritn_mutex;
 
                                 if (cx == 1 && cy == 1 && cz == 1) { // current chunk
                                     NB(nx + 1, ny + 1, nz + 1) = unpacked[coords_to_index<Chunk::size>(rx, ry, rz)];
-                                    NL(nx + 1, ny + 1, nz + 1) = chunk->m_light_map[coords_to_index<Chunk::size>(rx, ry, rz)];
+                                    NL(nx + 1, ny + 1, nz + 1) = unpacked_light[coords_to_index<Chunk::size>(rx, ry, rz)];
                                     continue;
                                 }
 
                                 auto c = NC(cx, cy, cz);
-                                NB(nx + 1, ny + 1, nz + 1) = c->m_storage.get_block(coords_to_index<Chunk::size>(rx, ry, rz));
-                                NL(nx + 1, ny + 1, nz + 1) = c->m_light_map[coords_to_index<Chunk::size>(rx, ry, rz)];
+                                NB(nx + 1, ny + 1, nz + 1) = c->m_storage->get(coords_to_index<Chunk::size>(rx, ry, rz));
+                                NL(nx + 1, ny + 1, nz + 1) = c->m_light->get(coords_to_index<Chunk::size>(rx, ry, rz));
                             }
                         }
                     }
@@ -223,7 +206,6 @@ std::mutex pritn_mutex;
                 }
             }
         }
-        return true;
     }
 #undef NL
 #undef NB
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <array>
 #include <vector>
 
 #include "../util.hpp"
@@ -12,6 +13,15 @@ namespace renderer {
     struct ChunkMesh;
     class ChunkRenderer;
 
+    // The chunk to mesh and the 26 around it, which the mesher reads the blocks and light along
+    // the border from. Indexed with coords_to_index<3>, the chunk itself sits at (1, 1, 1).
+    // All of them have to be decorated already.
+    struct ChunkNeighborhood {
+        std::array<Chunk*, 3 * 3 * 3> chunks;
+
+        inline Chunk* center() const { return chunks[coords_to_index<3>(1, 1, 1)]; }
+    };
+
     class ChunkMeshBuilder {
         void push_transparent_face_indices();
 
@@ -22,7 +32,7 @@ namespace renderer {
         std::vector<u32> m_transparent_indices;
         i32 m_last_transparent_index;
 
-        bool build(Chunk *chunk);
+        void build(const ChunkNeighborhood &neighborhood);
 
         ChunkMeshBuilder();
         ~ChunkMeshBuilder();
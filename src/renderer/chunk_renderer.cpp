@@ -268,6 +268,8 @@ namespace renderer {
             chunk->m_mesh = mesh;
             upload_chunk_mesh(mesh_builder, mesh);
             m_available_mesh_builders.enqueue(mesh_builder);
+            // last touch of the chunk, the world may free it once nothing is in flight
+            chunk->m_meshes_in_flight.fetch_sub(1, std::memory_order_release);
             m_meshes.emplace(mesh);
 
             auto stop = std::chrono::steady_clock::now();
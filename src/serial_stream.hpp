@@ -0,0 +1,166 @@
+#pragma once
+
+#include <span>
+#include <vector>
+#include <cstring>
+
+#include "util.hpp"
+
+// Forward-only binary writer. Fixed-size values are stored as they are in memory, lengths and
+// counts as LEB128 varints.
+class SerialWriter {
+    std::vector<u8> m_bytes;
+
+public:
+    usize size() const {
+        return m_bytes.size();
+    }
+
+    const u8* data() const {
+        return m_bytes.data();
+    }
+
+    // hands over the written bytes, the writer is empty afterwards
+    std::vector<u8> take() {
+        return std::move(m_bytes);
+    }
+
+    // makes room for num_bytes to be filled in place, returns where they start
+    u8* reserve(usize num_bytes) {
+        usize index = m_bytes.size();
+        m_bytes.resize(index + num_bytes);
+        return &m_bytes[index];
+    }
+
+    void shrink(usize num_bytes) {
+        m_bytes.resize(m_bytes.size() - num_bytes);
+    }
+
+    template<TriviallyCopyable T>
+    void write(const T &value) {
+        std::memcpy(reserve(sizeof(T)), &value, sizeof(T));
+    }
+
+    // overwrites a value written earlier, for sizes only known afterwards
+    template<TriviallyCopyable T>
+    void write_at(usize index, const T &value) {
+        std::memcpy(&m_bytes[index], &value, sizeof(T));
+    }
+
+    void write_varint(u64 value) {
+        while (value >= 0x80) {
+            m_bytes.push_back((u8)(value | 0x80));
+            value >>= 7;
+        }
+        m_bytes.push_back((u8)value);
+    }
+
+    void write_bytes(const void *data, usize size) {
+        if (size != 0)
+            std::memcpy(reserve(size), data, size);
+    }
+
+    // the count followed by the values themselves
+    template<TriviallyCopyable T>
+    void write_span(std::span<const T> values) {
+        write_varint(values.size());
+        write_bytes(values.data(), values.size_bytes());
+    }
+
+    void write_header(u32 magic, u32 version) {
+        write(magic);
+        write_varint(version);
+    }
+};
+
+// Reads what SerialWriter wrote straight from any memory (a vector, an mmap, a network buffer)
+// without copying it first. Reading past the end marks the reader as failed and yields zeroes
+// instead, so callers only have to check ok() once they are done.
+class SerialReader {
+    std::span<const u8> m_bytes;
+    usize m_cursor = 0;
+    bool m_failed = false;
+
+public:
+    SerialReader(std::span<const u8> bytes) : m_bytes(bytes) {}
+    SerialReader(const u8 *data, usize size) : m_bytes(data, size) {}
+
+    bool ok() const {
+        return !m_failed;
+    }
+
+    void fail() {
+        m_failed = true;
+        m_cursor = m_bytes.size();
+    }
+
+    usize remaining() const {
+        return m_bytes.size() - m_cursor;
+    }
+
+    template<TriviallyCopyable T>
+    T read() {
+        T value {};
+        if (remaining() < sizeof(T)) {
+            fail();
+            return value;
+        }
+        std::memcpy(&value, &m_bytes[m_cursor], sizeof(T));
+        m_cursor += sizeof(T);
+        return value;
+    }
+
+    u64 read_varint() {
+        u64 value = 0;
+        for (uint shift = 0; shift < 64; shift += 7) {
+            if (remaining() == 0)
+                break;
+            u8 byte = m_bytes[m_cursor++];
+            value |= (u64)(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0)
+                return value;
+        }
+        fail(); // truncated or longer than 10 bytes
+        return 0;
+    }
+
+    // a view into the underlying memory, only valid as long as that memory is
+    std::span<const u8> read_bytes(usize size) {
+        if (remaining() < size) {
+            fail();
+            return {};
+        }
+        auto bytes = m_bytes.subspan(m_cursor, size);
+        m_cursor += size;
+        return bytes;
+    }
+
+    // reads what write_span wrote, copying since the values may be unaligned in the buffer
+    template<TriviallyCopyable T, typename A>
+    void read_vector(std::vector<T, A> &values) {
+        u64 count = read_varint();
+        if (count > remaining() / sizeof(T)) {
+            fail();
+            values.clear();
+            return;
+        }
+        values.resize(count);
+        auto bytes = read_bytes(count * sizeof(T));
+        if (count != 0)
+            std::memcpy(values.data(), bytes.data(), bytes.size());
+    }
+
+    // returns the version, or 0 if the magic doesn't match or the version is newer than max_version
+    u32 read_header(u32 magic, u32 max_version) {
+        if (read<u32>() != magic) {
+            fail();
+            return 0;
+        }
+        u64 version = read_varint();
+        if (version == 0 || version > max_version) {
+            fail();
+            return 0;
+        }
+        return (u32)version;
+    }
+};
@@ -1,29 +1,98 @@
 #include "block_storage.hpp"
-#include "chunk.hpp"
 
+#include <bit>
 #include <cstring>
 #include <algorithm>
 
-BlockStorage::BlockStorage(uint size) {
+// same layout as PackedArray_create, but the memory comes from the chunk pools
+static PackedArray* create_packed_array(u32 bits_per_item, u32 count) {
+    usize buffer_size = sizeof(u32) * (((u64)count / 4 * (u64)bits_per_item + 31) / 32 * 4);
+    buffer_size += count < 4 ? sizeof(u32) * count : sizeof(u32) * 4;
+    auto *array = (PackedArray*)chunk_allocator::allocate(sizeof(PackedArray) + buffer_size);
+    array->buffer[buffer_size / sizeof(u32) - 1] = 0;
+    array->bitsPerItem = bits_per_item;
+    array->count = count;
+    return array;
+}
+
+// words actually holding items, the padding after them is never written
+static usize packed_words(u32 bits_per_item, u32 count) {
+    return ((u64)count * bits_per_item + 31) / 32;
+}
+
+static void destroy_packed_array(PackedArray *array) {
+    chunk_allocator::free(array);
+}
+
+// room for the unpacked indices of a storage, reused so bulk operations don't allocate every time.
+// Nothing holding it calls anything else that takes it.
+static u32* index_buffer(uint size) {
+    static thread_local std::vector<u32> buffer;
+    if (buffer.size() < size)
+        buffer.resize(size);
+    return buffer.data();
+}
+
+template<typename T>
+PaletteStorage<T>::PaletteStorage(uint size, T initial) {
     m_size = size;
     m_bits_per_index = 0;
     m_palette_size = 1;
     m_palette.resize(1 << m_bits_per_index);
-    m_palette[0] = { size, 0 };
+    m_palette[0] = { size, initial };
     m_data.single = &m_palette[0];
 }
 
-BlockStorage::~BlockStorage() {
-    if (m_palette_size > 1)
-        PackedArray_destroy(m_data.packed);
+template<typename T>
+PaletteStorage<T>::~PaletteStorage() {
+    if (m_bits_per_index != 0)
+        destroy_packed_array(m_data.packed);
 }
 
-void BlockStorage::set_block(uint index, BlockNID type) {
+template<typename T>
+void PaletteStorage<T>::fill(T value) {
+    if (m_bits_per_index != 0)
+        destroy_packed_array(m_data.packed);
+    m_bits_per_index = 0;
+    m_palette.assign(1, PaletteEntry { m_size, value });
+    m_palette_size = 1;
+    m_data.single = &m_palette[0];
+    m_free_entries.clear();
+    rebuild_palette_lookup();
+}
+
+template<typename T>
+i32 PaletteStorage<T>::find_palette_entry(T value) {
+    if (m_palette_lookup) {
+        auto it = m_palette_lookup->find(value);
+        return it != m_palette_lookup->end() ? (i32)it->second : -1;
+    }
+    for (uint i = 0; i < m_palette.size(); i++)
+        if (m_palette[i].value == value && m_palette[i].ref_count != 0)
+            return i;
+    return -1;
+}
+
+template<typename T>
+void PaletteStorage<T>::add_to_lookup(uint palette_index) {
+    if (m_palette_lookup)
+        (*m_palette_lookup)[m_palette[palette_index].value] = palette_index;
+}
+
+template<typename T>
+void PaletteStorage<T>::remove_from_lookup(uint palette_index) {
+    if (m_palette_lookup)
+        m_palette_lookup->erase(m_palette[palette_index].value);
+}
+
+template<typename T>
+void PaletteStorage<T>::set(uint index, T value) {
     if (m_bits_per_index == 0) {
-        if (type == m_data.single->type) return;
+        if (value == m_data.single->value) return;
         m_data.single->ref_count--;
         uint new_entry = new_palette_entry();
-        m_palette[new_entry] = { 1, type };
+        m_palette[new_entry] = { 1, value };
+        add_to_lookup(new_entry);
         PackedArray_set(m_data.packed, index, new_entry);
         m_palette_size++;
         return;
@@ -31,155 +100,434 @@ void BlockStorage::set_block(uint index, BlockNID type) {
 
     uint palette_index = PackedArray_get(m_data.packed, index);
     PaletteEntry *current = &m_palette[palette_index];
+    if (current->value == value)
+        return;
 
-    current->ref_count--;
-
-    // is the block type already in the palette?
-    auto replace = std::find_if(m_palette.begin(), m_palette.end(), [&] (PaletteEntry &entry) { return entry.type == type; });
-    if (replace != m_palette.end()) {
+    // is the value already in the palette?
+    i32 replace = find_palette_entry(value);
+    if (replace != -1) {
         // then use the existing palette entry
-        PackedArray_set(m_data.packed, index, replace - m_palette.begin());
-        replace->ref_count++;
+        PackedArray_set(m_data.packed, index, replace);
+        m_palette[replace].ref_count++;
+        if (--current->ref_count == 0)
+            free_palette_entry(palette_index);
         return;
     }
 
     // can we overwrite the current palette entry?
-    if (current->ref_count == 0) {
-        current->type = type;
+    if (--current->ref_count == 0) {
+        remove_from_lookup(palette_index);
+        current->value = value;
         current->ref_count = 1;
+        add_to_lookup(palette_index);
         return;
     }
 
     // get the first free palette entry, possibly growing the palette
     uint new_entry = new_palette_entry();
 
-    m_palette[new_entry] = { 1, type };
+    m_palette[new_entry] = { 1, value };
+    add_to_lookup(new_entry);
     PackedArray_set(m_data.packed, index, new_entry);
     m_palette_size++;
 }
 
-BlockNID BlockStorage::get_block(uint index) {
+template<typename T>
+T PaletteStorage<T>::get(uint index) {
     if (m_bits_per_index == 0)
-        return m_data.single->type;
+        return m_data.single->value;
 
     uint palette_index = PackedArray_get(m_data.packed, index);
-    return m_palette[palette_index].type;
+    return m_palette[palette_index].value;
+}
+
+template<typename T>
+void PaletteStorage<T>::set_all(const T *values) {
+    m_palette.clear();
+    m_palette_lookup.reset();
+    m_free_entries.clear();
+
+    // build the palette, runs of the same value are very common so skip the search for those
+    u32 *indices = index_buffer(m_size);
+    T last_value = values[0];
+    u32 last_index = 0;
+    m_palette.push_back({ 1, last_value });
+    indices[0] = 0;
+    for (uint i = 1; i < m_size; i++) {
+        if (values[i] != last_value) {
+            last_value = values[i];
+            i32 found = find_palette_entry(last_value);
+            if (found == -1) {
+                found = m_palette.size();
+                m_palette.push_back({ 0, last_value });
+                if (m_palette.size() > max_searched_palette && !m_palette_lookup) {
+                    m_palette_lookup = std::make_unique<PaletteLookup>();
+                    for (uint j = 0; j < m_palette.size(); j++)
+                        (*m_palette_lookup)[m_palette[j].value] = j;
+                }
+                add_to_lookup(found);
+            }
+            last_index = found;
+        }
+        m_palette[last_index].ref_count++;
+        indices[i] = last_index;
+    }
+
+    if (m_bits_per_index != 0)
+        destroy_packed_array(m_data.packed);
+
+    m_palette_size = m_palette.size();
+    m_bits_per_index = std::bit_width(m_palette_size - 1);
+    m_palette.resize(1 << m_bits_per_index, PaletteEntry { 0, 0 });
+    for (uint i = m_palette.size() - 1; i >= m_palette_size; i--)
+        m_free_entries.push_back(i);
+
+    if (m_bits_per_index == 0) {
+        m_data.single = &m_palette[0];
+    } else {
+        m_data.packed = create_packed_array(m_bits_per_index, m_size);
+        PackedArray_pack(m_data.packed, 0, indices, m_size);
+    }
 }
 
-uint BlockStorage::new_palette_entry() {
+template<typename T>
+void PaletteStorage<T>::get_all(T *values) {
     if (m_bits_per_index == 0) {
-        grow_palette();
-        return new_palette_entry();
+        std::fill_n(values, m_size, m_data.single->value);
+        return;
     }
 
-    auto first_free = std::find_if(m_palette.begin(), m_palette.end(), [&] (PaletteEntry &entry) { return entry.ref_count == 0; });
-    if (first_free != m_palette.end())
-        return first_free - m_palette.begin();
+    if constexpr (sizeof(T) == sizeof(u32)) {
+        // unpack the indices in place
+        PackedArray_unpack(m_data.packed, 0, (u32*)values, m_size);
+        for (uint i = 0; i < m_size; i++)
+            values[i] = m_palette[values[i]].value;
+    } else {
+        u32 *indices = index_buffer(m_size);
+        PackedArray_unpack(m_data.packed, 0, indices, m_size);
+        for (uint i = 0; i < m_size; i++)
+            values[i] = m_palette[indices[i]].value;
+    }
+}
 
+template<typename T>
+uint PaletteStorage<T>::new_palette_entry() {
     // if no free entry, then grow the palette and the packed array
-    grow_palette();
+    if (m_free_entries.empty())
+        grow_palette();
+
+    uint first_free = m_free_entries.back();
+    m_free_entries.pop_back();
+    return first_free;
+}
 
-    // try again now
-    return new_palette_entry();
+template<typename T>
+void PaletteStorage<T>::free_palette_entry(uint palette_index) {
+    remove_from_lookup(palette_index);
+    m_palette[palette_index] = { 0, 0 };
+    m_free_entries.push_back(palette_index);
+    m_palette_size--;
 }
 
-void BlockStorage::grow_palette() {
+template<typename T>
+void PaletteStorage<T>::grow_palette() {
+    uint old_capacity = 1 << m_bits_per_index;
+
     if (m_bits_per_index == 0) {
         m_bits_per_index++;
         m_palette.resize(1 << m_bits_per_index);
 
-        u32 *zero = new u32[m_size];
+        u32 *zero = index_buffer(m_size);
         std::memset(zero, 0, m_size * sizeof(u32));
-        m_data.packed = PackedArray_create(m_bits_per_index, m_size);
+        m_data.packed = create_packed_array(m_bits_per_index, m_size);
         PackedArray_pack(m_data.packed, 0, zero, m_size);
-        delete[] zero;
+    } else {
+        u32 *unpacked = index_buffer(m_size);
+        PackedArray_unpack(m_data.packed, 0, unpacked, m_size);
+        destroy_packed_array(m_data.packed);
+
+        // double the palette size
+        m_bits_per_index++;
+        m_palette.resize(1 << m_bits_per_index);
+
+        m_data.packed = create_packed_array(m_bits_per_index, m_size);
+        PackedArray_pack(m_data.packed, 0, unpacked, m_size);
+    }
+
+    // the new half of the palette is all free, push it so the lowest index gets used first
+    for (uint i = (1 << m_bits_per_index) - 1; i >= old_capacity; i--) {
+        m_palette[i] = { 0, 0 };
+        m_free_entries.push_back(i);
+    }
+    // past the size worth searching, every entry but the new ones is live
+    if (m_palette.size() > max_searched_palette && !m_palette_lookup) {
+        m_palette_lookup = std::make_unique<PaletteLookup>();
+        for (uint i = 0; i < old_capacity; i++)
+            (*m_palette_lookup)[m_palette[i].value] = i;
+    }
+}
+
+template<typename T>
+void PaletteStorage<T>::rebuild_palette_lookup() {
+    if (m_palette.size() > max_searched_palette)
+        m_palette_lookup = std::make_unique<PaletteLookup>();
+    else
+        m_palette_lookup.reset();
+    m_free_entries.clear();
+    for (uint i = m_palette.size(); i-- > 0;) {
+        if (m_palette[i].ref_count == 0)
+            m_free_entries.push_back(i);
+        else
+            add_to_lookup(i);
+    }
+}
+
+template<typename T>
+void PaletteStorage<T>::fit_palette() {
+    if (m_bits_per_index == 0)
+        return;
+
+    // is the palette at most half of its closest power-of-two?
+    uint new_bits_per_index = std::bit_width(m_palette_size - 1);
+    if (new_bits_per_index >= m_bits_per_index)
+        return; // NO: the palette cannot be shrunk!
+
+    // compact the live palette entries to the front, remembering where each one went
+    std::vector<u32> remap(m_palette.size());
+    Palette new_palette(1 << new_bits_per_index, PaletteEntry { 0, 0 });
+    uint palette_counter = 0;
+    for (uint i = 0; i < m_palette.size(); i++) {
+        if (m_palette[i].ref_count == 0)
+            continue;
+        remap[i] = palette_counter;
+        new_palette[palette_counter++] = m_palette[i];
+    }
+
+    if (new_bits_per_index == 0) {
+        // only a single value is left, so drop the packed array entirely
+        destroy_packed_array(m_data.packed);
+        m_bits_per_index = 0;
+        m_palette = std::move(new_palette);
+        m_data.single = &m_palette[0];
+        rebuild_palette_lookup();
         return;
     }
 
-    u32 *unpacked = new u32[m_size];
-    PackedArray_unpack(m_data.packed, 0, unpacked, m_size);
-    PackedArray_destroy(m_data.packed);
+    // decode all indices, re-encode them with the compacted palette
+    u32 *indices = index_buffer(m_size);
+    PackedArray_unpack(m_data.packed, 0, indices, m_size);
+    destroy_packed_array(m_data.packed);
+    for (uint i = 0; i < m_size; i++)
+        indices[i] = remap[indices[i]];
 
-    // double the palette size
-    m_bits_per_index++;
-    m_palette.resize(1 << m_bits_per_index);
+    m_bits_per_index = new_bits_per_index;
+    m_palette = std::move(new_palette);
+    m_data.packed = create_packed_array(m_bits_per_index, m_size);
+    PackedArray_pack(m_data.packed, 0, indices, m_size);
 
-    m_data.packed = PackedArray_create(m_bits_per_index, m_size);
-    PackedArray_pack(m_data.packed, 0, unpacked, m_size);
-    delete[] unpacked;
-}
-
-void BlockStorage::fit_palette() {
-    // // Remove old entries...
-    // for(int i = 0; i < palette.length; i++) {
-    //     if(palette[i].refcount == 0) {
-    //         palette[i] = null;
-    //         paletteCount -= 1;
-    //     }
-    // }
-
-    // // Is the palette less than half of its closest power-of-two?
-    // if(paletteCount > powerOfTwo(paletteCount)/2) {
-    //     // NO: The palette cannot be shrunk!
-    //     return;
-    // }
-
-    // // decode all indices
-    // int[] indices = new int[size];
-    // for(int i = 0; i < indices.length; i++) {
-    //     indices[i] = data.get(i * indicesLength, indicesLength);
-    // }
-
-    // // Create new palette, halfing it in size
-    // indicesLength = indicesLength >> 1;
-    // PaletteEntry[] newPalette = new PaletteEntry[2 pow indicesLength];
-
-    // // We gotta compress the palette entries!
-    // int paletteCounter = 0;
-    // for(int pi = 0; pi < palette.length; pi++, paletteCounter++) {
-    //     PaletteEntry entry = newPalette[paletteCounter] = palette[pi];
-
-    //     // Re-encode the indices (find and replace; with limit)
-    //     for(int di = 0, fc = 0; di < indices.length && fc < entry.refcount; di++) {
-    //         if(pi == indices[di]) {
-    //             indices[di] = paletteCounter;
-    //             fc += 1;
-    //         }
-    //     }
-    // }
-
-    // // Allocate new BitBuffer
-    // data = new BitBuffer(size * indicesLength); // the length is in bits, not bytes!
-
-    // // Encode the indices
-    // for(int i = 0; i < indices.length; i++) {
-    //     data.set(i * indicesLength, indicesLength, indices[i]);
-    // }
-}
-
-SerialBuffer& BlockStorage::serialize(SerialBuffer &buffer) {
-    buffer.push(m_palette);
-    if (m_bits_per_index != 0) {
-        usize index = buffer.reserve(Chunk::volume * sizeof(u32));
-        PackedArray_unpack(m_data.packed, 0, (u32*)&buffer[index], Chunk::volume);
-    }
-    buffer.push(m_size);
-    buffer.push(m_palette_size);
-    buffer.push(m_bits_per_index);
-    return buffer;
-}
-
-SerialBuffer& BlockStorage::deserialize(SerialBuffer &buffer) {
-    buffer.pop(m_bits_per_index);
-    buffer.pop(m_palette_size);
-    buffer.pop(m_size);
-    if (m_bits_per_index != 0) {
-        m_data.packed = PackedArray_create(m_bits_per_index, m_size);
-        PackedArray_pack(m_data.packed, 0, (u32*)&buffer[buffer.size() - Chunk::volume * sizeof(u32)], Chunk::volume);
-        buffer.shrink(Chunk::volume * sizeof(u32));
+    rebuild_palette_lookup();
+}
+
+template<typename T>
+u64 PaletteStorage<T>::content_hash() const {
+    u64 hash = 0xCBF29CE484222325ull ^ m_bits_per_index;
+    auto mix = [&] (u64 value) {
+        hash = (hash ^ value) * 0x100000001B3ull;
+        hash ^= hash >> 29;
+    };
+    if (m_bits_per_index == 0) {
+        mix((u64)m_data.single->value);
+        return hash;
+    }
+
+    for (auto &entry : m_palette)
+        mix((u64)entry.ref_count << 32 | (u64)entry.value);
+    usize num_words = packed_words(m_bits_per_index, m_size);
+    for (usize i = 0; i < num_words; i++)
+        mix(m_data.packed->buffer[i]);
+    return hash;
+}
+
+template<typename T>
+bool PaletteStorage<T>::same_content(const PaletteStorage &other) const {
+    if (m_size != other.m_size || m_bits_per_index != other.m_bits_per_index)
+        return false;
+    if (m_bits_per_index == 0)
+        return m_data.single->value == other.m_data.single->value;
+
+    for (uint i = 0; i < m_palette.size(); i++)
+        if (m_palette[i].ref_count != other.m_palette[i].ref_count || m_palette[i].value != other.m_palette[i].value)
+            return false;
+    return std::memcmp(m_data.packed->buffer, other.m_data.packed->buffer, packed_words(m_bits_per_index, m_size) * sizeof(u32)) == 0;
+}
+
+// How a storage is laid out on disk and on the wire. Only live palette entries are written and
+// indices refer to their position in that compacted palette.
+enum class StorageEncoding : u8 {
+    UNIFORM, // just the value
+    PACKED,  // palette, then every index at the palette's bit width, LSB first
+    RUNS,    // palette, then (run length, index) pairs, for storages with few long runs like light
+};
+
+static void pack_bits(const u32 *indices, uint count, uint bits, u8 *out) {
+    u64 accumulator = 0;
+    uint num_bits = 0;
+    for (uint i = 0; i < count; i++) {
+        accumulator |= (u64)indices[i] << num_bits;
+        num_bits += bits;
+        while (num_bits >= 8) {
+            *out++ = (u8)accumulator;
+            accumulator >>= 8;
+            num_bits -= 8;
+        }
+    }
+    if (num_bits > 0)
+        *out = (u8)accumulator;
+}
+
+static void unpack_bits(const u8 *in, uint count, uint bits, u32 *indices) {
+    u64 accumulator = 0;
+    uint num_bits = 0;
+    u32 mask = (1u << bits) - 1;
+    for (uint i = 0; i < count; i++) {
+        while (num_bits < bits) {
+            accumulator |= (u64)*in++ << num_bits;
+            num_bits += 8;
+        }
+        indices[i] = accumulator & mask;
+        accumulator >>= bits;
+        num_bits -= bits;
+    }
+}
+
+static usize varint_size(u64 value) {
+    return (std::bit_width(value | 1) + 6) / 7;
+}
+
+template<typename T>
+void PaletteStorage<T>::serialize(SerialWriter &writer) {
+    if (m_bits_per_index == 0) {
+        writer.write(StorageEncoding::UNIFORM);
+        writer.write_varint((u64)m_data.single->value);
+        return;
+    }
+
+    // drop free entries, so the indices need as few bits as possible
+    std::vector<u32> remap(m_palette.size());
+    std::vector<T> values;
+    for (uint i = 0; i < m_palette.size(); i++) {
+        if (m_palette[i].ref_count == 0)
+            continue;
+        remap[i] = values.size();
+        values.push_back(m_palette[i].value);
+    }
+
+    u32 *indices = index_buffer(m_size);
+    PackedArray_unpack(m_data.packed, 0, indices, m_size);
+    usize runs_size = 0;
+    for (uint i = 0; i < m_size; i++) {
+        indices[i] = remap[indices[i]];
+        if (i == 0 || indices[i] != indices[i - 1])
+            runs_size += 2 + varint_size(indices[i]); // assumes runs need two bytes for their length
+    }
+
+    uint bits = std::bit_width(values.size() - 1);
+    usize packed_size = ((usize)m_size * bits + 7) / 8;
+    writer.write(runs_size < packed_size ? StorageEncoding::RUNS : StorageEncoding::PACKED);
+    writer.write_varint(values.size());
+    for (T value : values)
+        writer.write_varint((u64)value);
+
+    if (runs_size < packed_size) {
+        for (uint i = 0; i < m_size;) {
+            uint run_end = i + 1;
+            while (run_end < m_size && indices[run_end] == indices[i])
+                run_end++;
+            writer.write_varint(run_end - i);
+            writer.write_varint(indices[i]);
+            i = run_end;
+        }
     } else {
-        m_data.single = &m_palette[0];
+        pack_bits(indices, m_size, bits, writer.reserve(packed_size));
     }
-    buffer.pop(m_palette, 1 << m_bits_per_index);
-    return buffer;
 }
+
+template<typename T>
+bool PaletteStorage<T>::deserialize(SerialReader &reader, u64 max_value) {
+    // everything is decoded on the side, the storage only changes once all of it checked out
+    auto invalid = [&] {
+        reader.fail();
+        return false;
+    };
+    auto read_value = [&] (T &value) {
+        u64 raw = reader.read_varint();
+        value = (T)raw;
+        return reader.ok() && raw <= max_value && raw == (u64)value;
+    };
+
+    auto encoding = reader.read<StorageEncoding>();
+    if (encoding == StorageEncoding::UNIFORM) {
+        T value;
+        if (!read_value(value))
+            return invalid();
+        fill(value);
+        return true;
+    }
+    if (encoding != StorageEncoding::PACKED && encoding != StorageEncoding::RUNS)
+        return invalid();
+
+    u64 palette_size = reader.read_varint();
+    if (!reader.ok() || palette_size < 2 || palette_size > m_size)
+        return invalid();
+    uint bits = std::bit_width(palette_size - 1);
+    Palette palette(1 << bits, PaletteEntry { 0, 0 });
+    for (uint i = 0; i < palette_size; i++)
+        if (!read_value(palette[i].value))
+            return invalid();
+
+    u32 *indices = index_buffer(m_size);
+    if (encoding == StorageEncoding::PACKED) {
+        auto bytes = reader.read_bytes(((usize)m_size * bits + 7) / 8);
+        if (!reader.ok())
+            return invalid();
+        unpack_bits(bytes.data(), m_size, bits, indices);
+    } else {
+        for (uint i = 0; i < m_size;) {
+            u64 length = reader.read_varint();
+            u64 index = reader.read_varint();
+            if (!reader.ok() || length == 0 || length > m_size - i || index >= palette_size)
+                return invalid();
+            std::fill_n(indices + i, length, (u32)index);
+            i += length;
+        }
+    }
+
+    for (uint i = 0; i < m_size; i++) {
+        if (indices[i] >= palette_size)
+            return invalid();
+        palette[indices[i]].ref_count++;
+    }
+    // a palette entry nothing points at or a value listed twice would confuse set() later on
+    std::vector<T> values(palette_size);
+    for (uint i = 0; i < palette_size; i++) {
+        if (palette[i].ref_count == 0)
+            return invalid();
+        values[i] = palette[i].value;
+    }
+    std::sort(values.begin(), values.end());
+    if (std::adjacent_find(values.begin(), values.end()) != values.end())
+        return invalid();
+
+    if (m_bits_per_index != 0)
+        destroy_packed_array(m_data.packed);
+    m_palette = std::move(palette);
+    m_palette_size = palette_size;
+    m_bits_per_index = bits;
+    m_data.packed = create_packed_array(m_bits_per_index, m_size);
+    PackedArray_pack(m_data.packed, 0, indices, m_size);
+    rebuild_palette_lookup();
+    return true;
+}
+
+template class PaletteStorage<BlockNID>;
+template class PaletteStorage<u16>;
@@ -1,40 +1,87 @@
 #pragma once
 
+#include <limits>
+#include <memory>
 #include <vector>
+#include <unordered_map>
 #include <PackedArray/PackedArray.h>
 
+#include "chunk_allocator.hpp"
 #include "../block/block.hpp"
-#include "../serial_buffer.hpp"
+#include "../serial_stream.hpp"
 
 // based on https://www.reddit.com/r/VoxelGameDev/comments/9yu8qy/palettebased_compression_for_chunked_discrete/
-class BlockStorage {
+// Stores a value per voxel, without any packed array while every voxel holds the same value,
+// and with as few bits per voxel as the number of distinct values needs otherwise
+template<typename T>
+class PaletteStorage {
 public:
     struct PaletteEntry {
         u32 ref_count;
-        BlockNID type;
+        T value;
     };
 
+    using Palette = std::vector<PaletteEntry, ChunkPoolAllocator<PaletteEntry>>;
+
     union Data {
         PaletteEntry *single;
         PackedArray *packed;
     } m_data;
     uint m_size;
-    std::vector<PaletteEntry> m_palette;
+    Palette m_palette;
     uint m_palette_size;
     uint m_bits_per_index;
 
+    // value -> palette index, only contains entries with a non-zero ref count. Only built for
+    // palettes too large to search, nearly every storage (light above all) gets by without one.
+    using PaletteLookup = std::unordered_map<T, u32, std::hash<T>, std::equal_to<T>, ChunkPoolAllocator<std::pair<const T, u32>>>;
+    static constexpr uint max_searched_palette = 16;
+    std::unique_ptr<PaletteLookup> m_palette_lookup;
+    // palette indices with a zero ref count
+    std::vector<u32, ChunkPoolAllocator<u32>> m_free_entries;
+
+    // the palette index holding value, or -1
+    i32 find_palette_entry(T value);
+    // keeps the lookup up to date after an entry got a value or lost its last reference
+    void add_to_lookup(uint palette_index);
+    void remove_from_lookup(uint palette_index);
     uint new_palette_entry();
+    void free_palette_entry(uint palette_index);
     void grow_palette();
+    void rebuild_palette_lookup();
+
+    PaletteStorage(uint size, T initial = 0);
+    ~PaletteStorage();
+    PaletteStorage(const PaletteStorage &other) = delete;
+
+    static void* operator new(usize size) { return chunk_allocator::allocate(size); }
+    static void operator delete(void *ptr) { chunk_allocator::free(ptr); }
 
-    BlockStorage(uint size);
-    ~BlockStorage();
+    void set(uint index, T value);
+    T get(uint index);
 
-    void set_block(uint index, BlockNID type);
-    BlockNID get_block(uint index);
+    // replaces the whole storage in one go, building the palette from scratch and packing once
+    void set_all(const T *values);
+    void get_all(T *values);
+
+    // replaces every value, leaving the storage uniform without touching a packed array
+    void fill(T value);
+
+    inline bool is_uniform() const { return m_bits_per_index == 0; }
+    inline T uniform_value() const { return m_data.single->value; }
 
     // gotta shrink the palette every now and then
     void fit_palette();
 
-    SerialBuffer& serialize(SerialBuffer &buffer);
-    SerialBuffer& deserialize(SerialBuffer &buffer);
+    // two storages with the same hash and same_content hold exactly the same palette and indices
+    u64 content_hash() const;
+    bool same_content(const PaletteStorage &other) const;
+
+    void serialize(SerialWriter &writer);
+    // Replaces the contents, returns false without touching the storage if the data is invalid,
+    // which includes values above max_value
+    bool deserialize(SerialReader &reader, u64 max_value = std::numeric_limits<T>::max());
 };
+
+using BlockStorage = PaletteStorage<BlockNID>;
+using LightStorage = PaletteStorage<u16>;
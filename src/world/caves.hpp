@@ -0,0 +1,27 @@
+#pragma once
+
+#include <algorithm>
+
+#include "../util.hpp"
+
+// How shape_chunk carves caves: 3D simplex noise, scaled by a multiplier that grows with depth,
+// opens a cave wherever it reaches threshold. Shared with the benchmark that checks what
+// interpolating the noise does to them.
+namespace caves {
+    constexpr f32 frequency = 0.019f;
+    // sampled every noise_factor blocks and interpolated, full resolution made caves the bulk of shaping
+    constexpr i32 noise_factor = 4;
+    constexpr f32 threshold = 75.0f;
+
+    inline f32 multiplier(i32 world_y) {
+        return 50.0f - 25.0f * std::clamp((world_y + 32.0f) / 64.0f, 0.0f, 1.0f);
+    }
+
+    inline f32 density(f32 noise, i32 world_y) {
+        return (noise + 1.0f) * multiplier(world_y);
+    }
+
+    inline bool is_cave(f32 noise, i32 world_y) {
+        return density(noise, world_y) >= threshold;
+    }
+}
@@ -1,43 +1,138 @@
 #include "chunk.hpp"
-#include "../game.hpp"
-#include <lz4.h>
+#include "storage_dedup.hpp"
+#include "world.hpp"
 
-Chunk::Chunk(i32vec3 chunk_pos) : m_chunk_pos(chunk_pos), m_storage(Chunk::volume) {
-    std::memset(m_light_map, ~(u16)0, sizeof(m_light_map));
+// most chunks never see a block change, so only reserve a single block of the queue up front
+Chunk::Chunk(i32vec3 chunk_pos) : m_chunk_pos(chunk_pos), m_storage(new BlockStorage(Chunk::volume)), m_light(new LightStorage(Chunk::volume, ~(u16)0)), m_blocks_to_change(ChunkQueueTraits::BLOCK_SIZE) {}
+
+Chunk::~Chunk() {
+    if (m_storage_shared) storage_dedup::release(m_storage, m_storage_hash);
+    else delete m_storage;
+    if (m_light_shared) storage_dedup::release(m_light, m_light_hash);
+    else delete m_light;
+    if (m_baseline) storage_dedup::release(m_baseline, m_baseline_hash);
+}
+
+Chunk* Chunk::void_chunk() {
+    // never freed, pointers to it are handed out until the very end
+    static Chunk *chunk = [] {
+        Chunk *chunk = new Chunk(i32vec3(INT_MAX));
+        chunk->m_decorated.test_and_set();
+        return chunk;
+    }();
+    return chunk;
 }
-Chunk::~Chunk() {}
 
-void Chunk::change_block_at(i32vec3 offset, BlockNID block_nid) {
+void Chunk::change_block_at(World &world, i32vec3 offset, BlockNID block_nid) {
     uint index = coords_to_index<Chunk::size>(offset.x, offset.y, offset.z);
     m_blocks_to_change.enqueue(BlockChange(index, block_nid));
-    auto world = Game::get()->world();
-    world->mark_chunk_dirty(this);
-    if (offset.x == 0) world->mark_chunk_mesh_dirty(m_chunk_pos + i32vec3(-1, 0, 0));
-    else if (offset.x == Chunk::size - 1) world->mark_chunk_mesh_dirty(m_chunk_pos + i32vec3(1, 0, 0));
-    if (offset.y == 0) world->mark_chunk_mesh_dirty(m_chunk_pos + i32vec3(0, -1, 0));
-    else if (offset.y == Chunk::size - 1) world->mark_chunk_mesh_dirty(m_chunk_pos + i32vec3(0, 1, 0));
-    if (offset.z == 0) world->mark_chunk_mesh_dirty(m_chunk_pos + i32vec3(0, 0, -1));
-    else if (offset.z == Chunk::size - 1) world->mark_chunk_mesh_dirty(m_chunk_pos + i32vec3(0, 0, 1));
+    world.mark_chunk_dirty(this);
+    if (offset.x == 0) world.mark_chunk_mesh_dirty(m_chunk_pos + i32vec3(-1, 0, 0));
+    else if (offset.x == Chunk::size - 1) world.mark_chunk_mesh_dirty(m_chunk_pos + i32vec3(1, 0, 0));
+    if (offset.y == 0) world.mark_chunk_mesh_dirty(m_chunk_pos + i32vec3(0, -1, 0));
+    else if (offset.y == Chunk::size - 1) world.mark_chunk_mesh_dirty(m_chunk_pos + i32vec3(0, 1, 0));
+    if (offset.z == 0) world.mark_chunk_mesh_dirty(m_chunk_pos + i32vec3(0, 0, -1));
+    else if (offset.z == Chunk::size - 1) world.mark_chunk_mesh_dirty(m_chunk_pos + i32vec3(0, 0, 1));
 }
 
 void Chunk::apply_changes() {
     BlockChange block_changes[16];
-    while (usize num = m_blocks_to_change.try_dequeue_bulk(block_changes, 16))
+    std::unique_lock guard(m_storage_mutex, std::defer_lock);
+    while (usize num = m_blocks_to_change.try_dequeue_bulk(block_changes, 16)) {
+        if (!guard.owns_lock()) {
+            guard.lock();
+            own_storage();
+            own_light();
+        }
         for (usize i = 0; i < num; i++)
-            set_block(block_changes[i].index, block_changes[i].block_nid);
+            write_block(block_changes[i].index, block_changes[i].block_nid);
+    }
+
+    // blocks may have been removed entirely, so the palettes might fit in fewer bits now. Sharing
+    // waits for World::check_chunks, this chunk is likely to be written again soon.
+    if (guard.owns_lock()) {
+        m_storage->fit_palette();
+        m_light->fit_palette();
+        m_settling.test_and_set();
+    }
+}
+
+void Chunk::share_storage() {
+    // only the tick thread shares and unshares, and never while another pass writes this chunk
+    if (m_storage_shared && m_light_shared)
+        return;
+    std::scoped_lock guard(m_storage_mutex);
+    if (!m_storage_shared) {
+        m_storage = storage_dedup::share(m_storage, m_storage_hash);
+        m_storage_shared = true;
+    }
+    if (!m_light_shared) {
+        m_light = storage_dedup::share(m_light, m_light_hash);
+        m_light_shared = true;
+    }
+}
+
+void Chunk::own_storage() {
+    if (m_storage_shared) {
+        m_storage = storage_dedup::unshare(m_storage, m_storage_hash);
+        m_storage_shared = false;
+    }
+}
+
+void Chunk::own_light() {
+    if (m_light_shared) {
+        m_light = storage_dedup::unshare(m_light, m_light_hash);
+        m_light_shared = false;
+    }
+}
+
+void Chunk::keep_baseline() {
+    share_storage();
+    if (m_baseline)
+        storage_dedup::release(m_baseline, m_baseline_hash);
+    storage_dedup::retain(m_storage, m_storage_hash);
+    m_baseline = m_storage;
+    m_baseline_hash = m_storage_hash;
+}
+
+void Chunk::set_baseline(const BlockNID *blocks) {
+    if (m_baseline)
+        storage_dedup::release(m_baseline, m_baseline_hash);
+    auto *baseline = new BlockStorage(Chunk::volume);
+    baseline->set_all(blocks);
+    m_baseline = storage_dedup::share(baseline, m_baseline_hash);
+}
+
+bool Chunk::get_baseline(BlockNID *blocks) {
+    if (!m_baseline)
+        return false;
+    m_baseline->get_all(blocks); // shared storages never change, no lock needed
+    return true;
 }
 
 BlockNID Chunk::get_block_at(i32vec3 offset) {
-    return m_storage.get_block(coords_to_index<Chunk::size>(offset.x, offset.y, offset.z));
+    std::shared_lock guard(m_storage_mutex);
+    return m_storage->get(coords_to_index<Chunk::size>(offset.x, offset.y, offset.z));
+}
+
+BlockNID Chunk::get_block_at_unlocked(i32vec3 offset) {
+    return m_storage->get(coords_to_index<Chunk::size>(offset.x, offset.y, offset.z));
 }
 
 void Chunk::set_block(uint index, BlockNID block_nid) {
+    std::scoped_lock guard(m_storage_mutex);
+    own_storage();
+    own_light();
+    write_block(index, block_nid);
+}
+
+void Chunk::write_block(uint index, BlockNID block_nid) {
     if (get_block_data(block_nid)->m_top_transparent)
-        m_light_map[index] = ~(u16)0; // set full light
+        m_light->set(index, ~(u16)0); // set full light
     else
-        m_light_map[index] = (u16)0; // set no light
+        m_light->set(index, (u16)0); // set no light
 
-    m_storage.set_block(index, block_nid);
+    m_storage->set(index, block_nid);
 }
 
 void Chunk::set_block_at(i32vec3 offset, BlockNID block_nid) {
@@ -45,37 +140,90 @@ void Chunk::set_block_at(i32vec3 offset, BlockNID block_nid) {
     set_block(index, block_nid);
 }
 
+void Chunk::get_blocks(BlockNID *blocks) {
+    m_storage->get_all(blocks);
+}
+
+void Chunk::get_light(u16 *light) {
+    m_light->get_all(light);
+}
+
+void Chunk::set_blocks(const BlockNID *blocks) {
+    u16 light[Chunk::volume];
+    initial_light(blocks, light);
+
+    std::scoped_lock guard(m_storage_mutex);
+    own_storage();
+    own_light();
+    m_storage->set_all(blocks);
+    m_light->set_all(light);
+}
+
+void Chunk::fill_blocks(BlockNID block_nid) {
+    std::scoped_lock guard(m_storage_mutex);
+    own_storage();
+    own_light();
+    m_storage->fill(block_nid);
+    m_light->fill(get_block_data(block_nid)->m_top_transparent ? ~(u16)0 : (u16)0);
+}
+
+void Chunk::initial_light(const BlockNID *blocks, u16 *light) {
+    BlockNID last_block = blocks[0];
+    u16 last_light = get_block_data(last_block)->m_top_transparent ? ~(u16)0 : (u16)0;
+    for (uint i = 0; i < Chunk::volume; i++) {
+        if (blocks[i] != last_block) {
+            last_block = blocks[i];
+            last_light = get_block_data(last_block)->m_top_transparent ? ~(u16)0 : (u16)0;
+        }
+        light[i] = last_light;
+    }
+}
+
+void Chunk::set_blocks_in(i32vec3 min, i32vec3 max, const BlockNID *blocks) {
+    i32vec3 extent = max - min;
+    if (extent == i32vec3(Chunk::size)) {
+        set_blocks(blocks);
+        return;
+    }
+
+    std::scoped_lock guard(m_storage_mutex);
+    own_storage();
+    own_light();
+    BlockNID merged[Chunk::volume];
+    u16 light[Chunk::volume];
+    m_storage->get_all(merged);
+    m_light->get_all(light);
+    const BlockNID *current = blocks;
+    for (i32 y = min.y; y < max.y; y++) {
+        for (i32 z = min.z; z < max.z; z++) {
+            for (i32 x = min.x; x < max.x; x++) {
+                uint index = coords_to_index<Chunk::size>(x, y, z);
+                merged[index] = *current++;
+                light[index] = get_block_data(merged[index])->m_top_transparent ? ~(u16)0 : (u16)0;
+            }
+        }
+    }
+    m_storage->set_all(merged);
+    m_light->set_all(light);
+}
+
 u16 Chunk::get_light_at(i32vec3 offset) {
-    return m_light_map[coords_to_index<Chunk::size>(offset.x, offset.y, offset.z)];
+    return m_light->get(coords_to_index<Chunk::size>(offset.x, offset.y, offset.z));
 }
 
 void Chunk::set_light_at(i32vec3 offset, u16 light) {
-    m_light_map[coords_to_index<Chunk::size>(offset.x, offset.y, offset.z)] = light;
-}
-
-SerialBuffer& Chunk::serialize(SerialBuffer &buffer) {
-    SerialBuffer original {};
-    m_storage.serialize(original);
-    original.push(m_light_map, sizeof(m_light_map));
-    original.push(m_sunlight_map, sizeof(m_sunlight_map));
-
-    auto compressed = original.compress();
-    buffer.push(compressed.data(), compressed.size());
-    buffer.push((int)compressed.size());
-    buffer.push((int)original.size());
-    return buffer;
-}
-
-SerialBuffer& Chunk::deserialize(SerialBuffer &buffer) {
-    int original_size = 0, compressed_size = 0;
-    buffer.pop(original_size);
-    buffer.pop(compressed_size);
-    std::vector<u8> compressed(compressed_size);
-    buffer.pop(compressed.data(), compressed_size);
-
-    SerialBuffer decompressed = SerialBuffer::decompress(compressed, original_size);
-    decompressed.pop(m_sunlight_map, sizeof(m_sunlight_map));
-    decompressed.pop(m_light_map, sizeof(m_light_map));
-    m_storage.deserialize(decompressed);
-    return buffer;
+    own_light();
+    m_light->set(coords_to_index<Chunk::size>(offset.x, offset.y, offset.z), light);
+    m_settling.test_and_set();
+}
+
+bool Chunk::serialize(SerialWriter &writer, const chunk_codec::Baseline *baseline) {
+    return chunk_codec::encode(writer, *m_storage, *m_light, m_sunlight_map, baseline);
+}
+
+bool Chunk::deserialize(SerialReader &reader, const chunk_codec::GenerateBaseline &generate_baseline) {
+    std::scoped_lock guard(m_storage_mutex);
+    own_storage();
+    own_light();
+    return chunk_codec::decode(reader, *m_storage, *m_light, m_sunlight_map, num_block_data(), generate_baseline);
 }
@@ -1,12 +1,17 @@
 #pragma once
 
+#include <shared_mutex>
 #include <moodycamel/concurrentqueue.h>
 #include <glm/ext/vector_int3_sized.hpp>
 
 #include "block_storage.hpp"
+#include "chunk_codec.hpp"
+#include "chunk_allocator.hpp"
 #include "../block/block.hpp"
 #include "../renderer/chunk_mesh.hpp"
 
+class World;
+
 struct BlockChange {
     uint index;
     BlockNID block_nid;
@@ -19,32 +24,90 @@ public:
     static constexpr i32 volume = size * size * size;
 
     i32vec3 m_chunk_pos;
-    BlockStorage m_storage;
-    u16 m_light_map[volume];
+    // both may be shared with other chunks holding the same contents, see storage_dedup.hpp
+    BlockStorage *m_storage;
+    LightStorage *m_light;
+    bool m_storage_shared = false;
+    bool m_light_shared = false;
+    // the content hashes the shared storages are filed under, so giving them up doesn't hash them again
+    u64 m_storage_hash = 0;
+    u64 m_light_hash = 0;
+    // What generation gave for the blocks, shared like the storages, so saving a delta doesn't
+    // have to generate it again. Touched by generation and saving only, which never overlap.
+    BlockStorage *m_baseline = nullptr;
+    u64 m_baseline_hash = 0;
+    // Only there for the render thread, which reads blocks with get_block_at in the middle of a
+    // tick. Block writes and storage swaps hold it exclusively, once per chunk and batch. The tick
+    // thread itself never reads a chunk in the pass that writes it, so its reads skip the lock,
+    // and light is never touched outside the tick, so it doesn't need it at all.
+    std::shared_mutex m_storage_mutex;
     u8 m_sunlight_map[volume / 2];
-    ConcurrentQueue<BlockChange> m_blocks_to_change;
+    ConcurrentQueue<BlockChange, ChunkQueueTraits> m_blocks_to_change;
     renderer::ChunkMesh *m_mesh = nullptr;
+    // meshes built from this chunk that the renderer hasn't taken yet, it can't be freed until they are
+    std::atomic<u32> m_meshes_in_flight = 0;
 
     std::atomic_flag m_decorated = ATOMIC_FLAG_INIT;
     std::atomic_flag m_will_mesh = ATOMIC_FLAG_INIT;
     std::atomic_flag m_dirty = ATOMIC_FLAG_INIT;
     std::atomic_flag m_mesh_dirty = ATOMIC_FLAG_INIT;
-    std::atomic_flag m_will_save = ATOMIC_FLAG_INIT;
+    std::atomic_flag m_will_save = ATOMIC_FLAG_INIT; // differs from what generation gives, so it gets persisted
+    std::atomic_flag m_save_queued = ATOMIC_FLAG_INIT; // changed since it was last serialized
+    std::atomic_flag m_settling = ATOMIC_FLAG_INIT; // written since the last check, so not shared again yet
 
     Chunk(i32vec3 chunk_pos);
     ~Chunk();
     Chunk(const Chunk &other) = delete;
 
-    void change_block_at(i32vec3 offset, BlockNID block_nid);
+    static void* operator new(usize size) { return chunk_allocator::allocate(size); }
+    static void operator delete(void *ptr) { chunk_allocator::free(ptr); }
+
+    // Shared stand-in for every chunk that is all void and fully lit, so empty space above the
+    // terrain doesn't cost a chunk each. It must never be written to, the world swaps in a
+    // real chunk first (see World::materialize_chunk).
+    static Chunk* void_chunk();
+    inline bool is_void() const { return this == void_chunk(); }
+
+    void change_block_at(World &world, i32vec3 offset, BlockNID block_nid);
     void apply_changes();
 
     BlockNID get_block_at(i32vec3 offset);
+    // for the tick thread, see m_storage_mutex
+    BlockNID get_block_at_unlocked(i32vec3 offset);
     void set_block(uint index, BlockNID block_nid);
+    // set_block for a caller already holding m_storage_mutex and owning both storages
+    void write_block(uint index, BlockNID block_nid);
     void set_block_at(i32vec3 offset, BlockNID block_nid);
 
+    // bulk reads and writes, laid out in the same y, z, x order as coords_to_index. The reads are
+    // for the tick thread and don't lock.
+    void get_blocks(BlockNID *blocks);
+    void get_light(u16 *light);
+    void set_blocks(const BlockNID *blocks);
+    void set_blocks_in(i32vec3 min, i32vec3 max, const BlockNID *blocks); // max is exclusive
+    void fill_blocks(BlockNID block_nid);
+    // the light a chunk with these blocks starts out with, full where the block lets light through
+    static void initial_light(const BlockNID *blocks, u16 *light);
+
+    // Deduplicates the storages against every other chunk, call once the contents have settled.
+    // Generation does it right away, edited chunks once they went a whole tick without a write.
+    void share_storage();
+    // Gets private copies of shared storages back, has to happen before any write to them.
+    // own_storage's caller holds m_storage_mutex.
+    void own_storage();
+    void own_light();
+
+    // remembers the blocks as the baseline, keep_baseline shares the just generated storage for it
+    void keep_baseline();
+    void set_baseline(const BlockNID *blocks);
+    // false if no baseline is remembered
+    bool get_baseline(BlockNID *blocks);
+
     u16 get_light_at(i32vec3 offset);
     void set_light_at(i32vec3 offset, u16 light);
 
-    SerialBuffer& serialize(SerialBuffer &buffer);
-    SerialBuffer& deserialize(SerialBuffer &buffer);
+    // saves a delta against baseline if there is one, see chunk_codec.hpp. False if nothing was written.
+    bool serialize(SerialWriter &writer, const chunk_codec::Baseline *baseline = nullptr);
+    // returns false if the data is not a valid chunk, or a delta generate_baseline refuses
+    bool deserialize(SerialReader &reader, const chunk_codec::GenerateBaseline &generate_baseline = {});
 };
@@ -0,0 +1,116 @@
+#include "chunk_allocator.hpp"
+
+#include <new>
+#include <mutex>
+#include <array>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+
+namespace chunk_allocator {
+    // every block starts with a header that remembers its size class, so free() doesn't need the size
+    struct alignas(16) Header {
+        u32 size_class;
+        usize large_size; // only used by blocks too big for any size class
+    };
+    static_assert(sizeof(Header) == 16);
+
+    static constexpr u32 large_size_class = ~(u32)0;
+    static constexpr usize slab_size = 256 * 1024;
+
+    // four classes per power of two up to 64 KiB, so at most 25% of a block is wasted, all multiples of 16
+    static constexpr auto size_classes = [] {
+        std::array<usize, 43> classes { 32, 48, 64 };
+        usize i = 3;
+        for (usize base = 64; i < classes.size(); base *= 2)
+            for (usize quarter = 1; quarter <= 4; quarter++)
+                classes[i++] = base + base / 4 * quarter;
+        return classes;
+    }();
+    static_assert(size_classes.back() == 64 * 1024);
+
+    struct Pool {
+        ConcurrentQueue<void*> free_blocks;
+        std::mutex slab_mutex;
+        std::vector<void*> slabs;
+
+        ~Pool() {
+            for (void *slab : slabs)
+                ::operator delete(slab, std::align_val_t(64));
+        }
+    };
+
+    // constructed on first use, so chunks created during static initialization still work
+    static std::array<Pool, size_classes.size()>& pools() {
+        static std::array<Pool, size_classes.size()> pools;
+        return pools;
+    }
+
+    static std::atomic<usize> live_bytes = 0, peak_bytes = 0, reserved_bytes = 0;
+
+    static void track_allocation(usize size) {
+        usize live = live_bytes.fetch_add(size, std::memory_order_relaxed) + size;
+        usize peak = peak_bytes.load(std::memory_order_relaxed);
+        while (live > peak && !peak_bytes.compare_exchange_weak(peak, live, std::memory_order_relaxed));
+    }
+
+    static void* allocate_from_pool(u32 size_class) {
+        Pool &pool = pools()[size_class];
+        void *block;
+        if (pool.free_blocks.try_dequeue(block))
+            return block;
+
+        std::scoped_lock guard(pool.slab_mutex);
+        if (pool.free_blocks.try_dequeue(block))
+            return block; // another thread refilled the pool while we were waiting
+
+        usize block_size = size_classes[size_class];
+        usize num_blocks = std::max<usize>(1, slab_size / block_size);
+        u8 *slab = (u8*)::operator new(num_blocks * block_size, std::align_val_t(64));
+        pool.slabs.push_back(slab);
+        reserved_bytes += num_blocks * block_size;
+
+        std::vector<void*> new_blocks;
+        for (usize i = 1; i < num_blocks; i++)
+            new_blocks.push_back(slab + i * block_size);
+        pool.free_blocks.enqueue_bulk(new_blocks.data(), new_blocks.size());
+        return slab;
+    }
+
+    void* allocate(usize size) {
+        usize total_size = size + sizeof(Header);
+        Header *header;
+        if (total_size > size_classes.back()) {
+            header = (Header*)::operator new(total_size, std::align_val_t(16));
+            header->size_class = large_size_class;
+            header->large_size = total_size;
+            reserved_bytes += total_size;
+            track_allocation(total_size);
+        } else {
+            u32 size_class = std::lower_bound(size_classes.begin(), size_classes.end(), total_size) - size_classes.begin();
+            header = (Header*)allocate_from_pool(size_class);
+            header->size_class = size_class;
+            track_allocation(size_classes[size_class]);
+        }
+        return header + 1;
+    }
+
+    void free(void *ptr) {
+        if (!ptr)
+            return;
+        Header *header = (Header*)ptr - 1;
+        if (header->size_class == large_size_class) {
+            // large blocks are rare (only oversized palettes), so they just go back to the system
+            live_bytes -= header->large_size;
+            reserved_bytes -= header->large_size;
+            ::operator delete(header, std::align_val_t(16));
+            return;
+        }
+        live_bytes -= size_classes[header->size_class];
+        pools()[header->size_class].free_blocks.enqueue(header);
+    }
+
+    Stats stats() {
+        return { live_bytes.load(), peak_bytes.load(), reserved_bytes.load() };
+    }
+}
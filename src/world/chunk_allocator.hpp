@@ -0,0 +1,38 @@
+#pragma once
+
+#include <moodycamel/concurrentqueue.h>
+
+#include "../util.hpp"
+
+// Size-classed slab pools for chunks and everything hanging off of them (palettes, packed
+// arrays, change queues). Freed blocks go back to their pool and get reused by the next
+// chunk instead of going through the general purpose allocator every time.
+namespace chunk_allocator {
+    struct Stats {
+        usize live_bytes;     // handed out and not yet freed
+        usize peak_bytes;     // highest live_bytes so far
+        usize reserved_bytes; // slabs taken from the system, including free blocks
+    };
+
+    void* allocate(usize size);
+    void free(void *ptr);
+    Stats stats();
+}
+
+template<typename T>
+struct ChunkPoolAllocator {
+    using value_type = T;
+
+    ChunkPoolAllocator() = default;
+    template<typename U> ChunkPoolAllocator(const ChunkPoolAllocator<U> &) {}
+
+    T* allocate(usize n) { return (T*)chunk_allocator::allocate(n * sizeof(T)); }
+    void deallocate(T *ptr, usize) { chunk_allocator::free(ptr); }
+
+    template<typename U> bool operator==(const ChunkPoolAllocator<U> &) const { return true; }
+};
+
+struct ChunkQueueTraits : ConcurrentQueueDefaultTraits {
+    static inline void* malloc(usize size) { return chunk_allocator::allocate(size); }
+    static inline void free(void *ptr) { chunk_allocator::free(ptr); }
+};
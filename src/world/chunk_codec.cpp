@@ -0,0 +1,267 @@
+#include "chunk_codec.hpp"
+
+#include <atomic>
+#include <fstream>
+#include <shared_mutex>
+#include <unordered_map>
+#define LZ4_STATIC_LINKING_ONLY // declares LZ4_attach_dictionary before it became stable in 1.10
+#include <lz4.h>
+
+namespace chunk_codec {
+    struct Dictionary {
+        u32 id;
+        std::vector<u8> data;
+        LZ4_stream_t stream; // with the dictionary loaded, every payload starts from it instead of loading it again
+    };
+
+    // Saves encode and loads decode on worker threads while a tool or world may still load
+    // dictionaries. Loaded ones are never freed or replaced, so a pointer stays valid without the lock.
+    static std::shared_mutex dictionaries_mutex;
+    static std::unordered_map<u32, std::unique_ptr<Dictionary>> dictionaries;
+    static std::atomic<Dictionary*> current_dictionary = nullptr;
+
+    u32 dictionary_id(std::span<const u8> data) {
+        u32 hash = 0x811C9DC5;
+        for (u8 byte : data)
+            hash = (hash ^ byte) * 0x01000193;
+        return hash != 0 ? hash : 1; // 0 means no dictionary
+    }
+
+    void load_dictionaries(const std::filesystem::path &directory) {
+        if (!std::filesystem::is_directory(directory))
+            return;
+
+        auto newest = std::filesystem::file_time_type::min();
+        Dictionary *newest_dictionary = nullptr;
+        for (auto &file : std::filesystem::directory_iterator(directory)) {
+            if (file.path().extension() != ".dict")
+                continue;
+            std::ifstream input(file.path(), std::ios::binary);
+            std::vector<u8> data((std::istreambuf_iterator<char>(input)), {});
+            if (data.empty() || data.size() > max_dictionary_size) {
+                log(LogLevel::ERROR, "ChunkCodec", "Ignoring dictionary {}, it is empty or too large", file.path());
+                continue;
+            }
+
+            auto dictionary = std::make_unique<Dictionary>();
+            dictionary->id = dictionary_id(data);
+            dictionary->data = std::move(data);
+            LZ4_initStream(&dictionary->stream, sizeof(LZ4_stream_t));
+            LZ4_loadDict(&dictionary->stream, (const char*)dictionary->data.data(), dictionary->data.size());
+
+            std::scoped_lock guard(dictionaries_mutex);
+            // the id is a hash of the contents, one that is already loaded is the same dictionary
+            Dictionary *loaded = dictionaries.try_emplace(dictionary->id, std::move(dictionary)).first->second.get();
+            if (file.last_write_time() >= newest) {
+                newest = file.last_write_time();
+                newest_dictionary = loaded;
+            }
+        }
+        if (newest_dictionary) {
+            current_dictionary.store(newest_dictionary, std::memory_order_release);
+            std::shared_lock guard(dictionaries_mutex);
+            log(LogLevel::INFO, "ChunkCodec", "Loaded {} dictionaries, compressing with {}", dictionaries.size(), newest_dictionary->id);
+        }
+    }
+
+    u32 current_dictionary_id() {
+        Dictionary *dictionary = current_dictionary.load(std::memory_order_acquire);
+        return dictionary ? dictionary->id : 0;
+    }
+
+    // the sunlight map is mostly one value, so (length, byte) runs
+    static void write_byte_runs(SerialWriter &writer, std::span<const u8> bytes) {
+        for (usize i = 0; i < bytes.size();) {
+            usize run_end = i + 1;
+            while (run_end < bytes.size() && bytes[run_end] == bytes[i])
+                run_end++;
+            writer.write_varint(run_end - i);
+            writer.write(bytes[i]);
+            i = run_end;
+        }
+    }
+
+    static bool read_byte_runs(SerialReader &reader, std::span<u8> bytes) {
+        for (usize i = 0; i < bytes.size();) {
+            u64 length = reader.read_varint();
+            u8 value = reader.read<u8>();
+            if (!reader.ok() || length == 0 || length > bytes.size() - i)
+                return false;
+            std::fill_n(&bytes[i], length, value);
+            i += length;
+        }
+        return true;
+    }
+
+    // values differing from the baseline, as runs of consecutive indices holding the same value
+    template<typename T>
+    static void write_delta_runs(SerialWriter &writer, const T *values, const T *baseline, usize size) {
+        struct Run {
+            usize gap, length;
+            T value;
+        };
+        std::vector<Run> runs;
+        usize last_end = 0;
+        for (usize i = 0; i < size;) {
+            if (values[i] == baseline[i]) {
+                i++;
+                continue;
+            }
+            usize run_end = i + 1;
+            while (run_end < size && values[run_end] == values[i] && values[run_end] != baseline[run_end])
+                run_end++;
+            runs.push_back({ i - last_end, run_end - i, values[i] });
+            last_end = i = run_end;
+        }
+
+        writer.write_varint(runs.size());
+        for (auto &run : runs) {
+            writer.write_varint(run.gap);
+            writer.write_varint(run.length);
+            writer.write_varint(run.value);
+        }
+    }
+
+    template<typename T>
+    static bool read_delta_runs(SerialReader &reader, T *values, usize size, u64 max_value = std::numeric_limits<T>::max()) {
+        u64 num_runs = reader.read_varint();
+        usize i = 0;
+        for (u64 run = 0; run < num_runs && reader.ok(); run++) {
+            u64 gap = reader.read_varint();
+            u64 length = reader.read_varint();
+            u64 value = reader.read_varint();
+            if (gap > size - i || length == 0 || length > size - i - gap || value > max_value || value != (T)value)
+                return false;
+            i += gap;
+            std::fill_n(&values[i], length, (T)value);
+            i += length;
+        }
+        return reader.ok();
+    }
+
+    static int compress_with(const Dictionary &dictionary, const char *source, char *destination, int source_size, int capacity) {
+        // every payload has to start from the bare dictionary, the stream remembers what it compressed
+        static thread_local LZ4_stream_t stream;
+#if LZ4_VERSION_NUMBER >= 11000
+        // references the dictionary's tables in place
+        LZ4_resetStream_fast(&stream);
+        LZ4_attach_dictionary(&stream, &dictionary.stream);
+#else
+        // LZ4_attach_dictionary is not exported before 1.10, a copy is still cheaper than LZ4_loadDict
+        stream = dictionary.stream;
+#endif
+        return LZ4_compress_fast_continue(&stream, source, destination, source_size, capacity, 1);
+    }
+
+    static bool compress(SerialWriter &writer, const SerialWriter &original, Format format) {
+        // the same dictionary for the id and the data, another one may get loaded meanwhile
+        const Dictionary *dictionary = current_dictionary.load(std::memory_order_acquire);
+        usize start = writer.size();
+        writer.write_header(magic, version);
+        writer.write_varint(dictionary ? dictionary->id : 0);
+        writer.write_varint((u64)format);
+        writer.write_varint(original.size());
+        // compress straight into the writer, the length in front gets filled in afterwards
+        usize length_index = writer.size();
+        writer.write<u32>(0);
+        int bound = LZ4_compressBound(original.size());
+        char *compressed = (char*)writer.reserve(bound);
+        int compressed_size = dictionary
+            ? compress_with(*dictionary, (const char*)original.data(), compressed, original.size(), bound)
+            : LZ4_compress_default((const char*)original.data(), compressed, original.size(), bound);
+        if (compressed_size <= 0) {
+            // only happens for inputs LZ4 can't take at all, don't leave a payload behind that claims otherwise
+            log(LogLevel::ERROR, "ChunkCodec", "Compressing {} bytes failed", original.size());
+            writer.shrink(writer.size() - start);
+            return false;
+        }
+        writer.shrink(bound - compressed_size);
+        writer.write_at(length_index, (u32)compressed_size);
+        return true;
+    }
+
+    bool encode(SerialWriter &writer, BlockStorage &blocks, LightStorage &light, std::span<const u8> sunlight, const Baseline *baseline) {
+        SerialWriter snapshot;
+        blocks.serialize(snapshot);
+        light.serialize(snapshot);
+        write_byte_runs(snapshot, sunlight);
+        if (!baseline)
+            return compress(writer, snapshot, Format::SNAPSHOT);
+
+        std::vector<BlockNID> block_values(blocks.m_size);
+        std::vector<u16> light_values(light.m_size);
+        blocks.get_all(block_values.data());
+        light.get_all(light_values.data());
+        SerialWriter delta;
+        delta.write(baseline->generator);
+        write_delta_runs(delta, block_values.data(), baseline->blocks, block_values.size());
+        write_delta_runs(delta, light_values.data(), baseline->light, light_values.size());
+        write_byte_runs(delta, sunlight);
+        // loading a delta means generating the chunk again, only worth it while the delta is smaller
+        if (delta.size() < snapshot.size())
+            return compress(writer, delta, Format::DELTA);
+        return compress(writer, snapshot, Format::SNAPSHOT);
+    }
+
+    bool decompress(SerialReader &reader, std::vector<u8> &original, Format *format) {
+        reader.read_header(magic, version);
+        u32 id = (u32)reader.read_varint();
+        u64 payload_format = reader.read_varint();
+        u64 original_size = reader.read_varint();
+        u32 compressed_size = reader.read<u32>();
+        auto compressed = reader.read_bytes(compressed_size);
+        // two storages with a palette entry and a run per value at worst, plus the sunlight runs.
+        // Deltas are only written while they are smaller than that.
+        constexpr usize max_original_size = 2 * 4096 * 3 * 10 + 2048 * 11 + 64;
+        if (!reader.ok() || original_size > max_original_size || payload_format > (u64)Format::DELTA)
+            return false;
+        if (format)
+            *format = (Format)payload_format;
+
+        const Dictionary *dictionary = nullptr;
+        if (id != 0) {
+            std::shared_lock guard(dictionaries_mutex);
+            auto it = dictionaries.find(id);
+            if (it == dictionaries.end()) {
+                log(LogLevel::ERROR, "ChunkCodec", "Payload needs dictionary {}, which is not loaded", id);
+                return false;
+            }
+            dictionary = it->second.get();
+        }
+
+        // the compressed bytes are read in place, only the decompressed ones need a buffer
+        original.resize(original_size);
+        int decompressed_size = dictionary
+            ? LZ4_decompress_safe_usingDict((const char*)compressed.data(), (char*)original.data(), compressed.size(), original.size(), (const char*)dictionary->data.data(), dictionary->data.size())
+            : LZ4_decompress_safe((const char*)compressed.data(), (char*)original.data(), compressed.size(), original.size());
+        return decompressed_size == (int)original_size;
+    }
+
+    bool decode(SerialReader &reader, BlockStorage &blocks, LightStorage &light, std::span<u8> sunlight, usize num_blocks, const GenerateBaseline &generate_baseline) {
+        if (num_blocks == 0)
+            return false;
+        std::vector<u8> original;
+        Format format;
+        if (!decompress(reader, original, &format))
+            return false;
+
+        SerialReader original_reader(original);
+        if (format == Format::SNAPSHOT) {
+            bool valid = blocks.deserialize(original_reader, num_blocks - 1) && light.deserialize(original_reader) && read_byte_runs(original_reader, sunlight);
+            return valid && original_reader.ok();
+        }
+
+        std::vector<BlockNID> block_values(blocks.m_size);
+        std::vector<u16> light_values(light.m_size);
+        u32 generator = original_reader.read<u32>();
+        if (!generate_baseline || !original_reader.ok() || !generate_baseline(generator, block_values.data(), light_values.data()))
+            return false;
+        if (!read_delta_runs(original_reader, block_values.data(), block_values.size(), num_blocks - 1)
+            || !read_delta_runs(original_reader, light_values.data(), light_values.size())
+            || !read_byte_runs(original_reader, sunlight))
+            return false;
+        blocks.set_all(block_values.data());
+        light.set_all(light_values.data());
+        return true;
+    }
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <span>
+#include <memory>
+#include <functional>
+#include <filesystem>
+
+#include "block_storage.hpp"
+
+// The chunk payload used by saves: a header, then the block storage, the light storage and the
+// sunlight map, LZ4 compressed. Storages keep their palette and bit packing (or runs, whichever
+// is smaller), so there is far less for LZ4 to chew through.
+//
+// Generation is deterministic, so a chunk can instead be saved as a delta: only the blocks and
+// light values that differ from what generating it again gives. Loading one regenerates the
+// chunk and replays the delta on top. That only gives back the saved chunk with the terrain it
+// was saved against: on new terrain, blocks the edits removed come back and ones they placed may
+// end up floating. So a delta records the generator and loading refuses it once that changed,
+// the chunk is generated again instead.
+namespace chunk_codec {
+    constexpr u32 magic = 0x48434B56; // "VKCH"
+    constexpr u32 version = 1;
+
+    enum class Format : u8 {
+        SNAPSHOT,
+        DELTA,
+    };
+
+    // what generation gives for the chunk being saved
+    struct Baseline {
+        u32 generator; // identifies seed and generator
+        const BlockNID *blocks;
+        const u16 *light;
+    };
+    // fills in the baseline for a delta that was saved against generator, false if that isn't the current one
+    using GenerateBaseline = std::function<bool(u32 generator, BlockNID *blocks, u16 *light)>;
+
+    // Shared history LZ4 can reference from the very first byte of a payload, trained on real
+    // chunks by tools/train_chunk_dictionary. Identified by a hash of its contents, which
+    // payloads and region headers store.
+    struct Dictionary;
+    constexpr usize max_dictionary_size = 64 * 1024; // LZ4 can't look back any further
+
+    u32 dictionary_id(std::span<const u8> data);
+    // Loads every *.dict file in directory, the most recently written one is used for encoding.
+    // Has to happen before any encode or decode, payloads need the dictionary they were written with.
+    void load_dictionaries(const std::filesystem::path &directory);
+    // 0 if there is none
+    u32 current_dictionary_id();
+
+    // Writes a delta against baseline if there is one and the delta is smaller, a snapshot otherwise.
+    // Returns false and writes nothing if compressing failed.
+    bool encode(SerialWriter &writer, BlockStorage &blocks, LightStorage &light, std::span<const u8> sunlight, const Baseline *baseline = nullptr);
+    // Returns false if the payload is not a valid chunk, holds block ids at or above num_blocks,
+    // or is a delta generate_baseline can't give the baseline for
+    bool decode(SerialReader &reader, BlockStorage &blocks, LightStorage &light, std::span<u8> sunlight, usize num_blocks, const GenerateBaseline &generate_baseline = {});
+
+    // the uncompressed contents, what dictionaries get trained on
+    bool decompress(SerialReader &reader, std::vector<u8> &original, Format *format = nullptr);
+}
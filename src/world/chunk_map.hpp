@@ -0,0 +1,116 @@
+#pragma once
+
+#include <bit>
+#include <array>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#define GLM_ENABLE_EXPERIMENTAL
+#include <glm/gtx/hash.hpp>
+
+#include "../util.hpp"
+
+class Chunk;
+
+// Chunk positions spread over independently locked shards, so workers touching different
+// parts of the world never wait on each other and lookups only ever take a shared lock
+class ChunkMap {
+public:
+    static constexpr usize num_shards = 64;
+    static_assert(std::has_single_bit(num_shards));
+
+private:
+    struct alignas(64) Shard {
+        std::shared_mutex mutex;
+        std::unordered_map<i32vec3, Chunk*> chunks;
+    };
+
+    std::array<Shard, num_shards> m_shards;
+
+    static usize shard_index(i32vec3 chunk_pos) {
+        // neighbouring chunks should land in different shards, so mix the hash before taking the top bits
+        u64 hash = std::hash<i32vec3>()(chunk_pos) * 0x9E3779B97F4A7C15ull;
+        return hash >> (64 - std::countr_zero(num_shards));
+    }
+
+    Shard& shard(i32vec3 chunk_pos) {
+        return m_shards[shard_index(chunk_pos)];
+    }
+
+public:
+    Chunk* find(i32vec3 chunk_pos) {
+        auto &s = shard(chunk_pos);
+        std::shared_lock guard(s.mutex);
+        auto it = s.chunks.find(chunk_pos);
+        return it != s.chunks.end() ? it->second : nullptr;
+    }
+
+    // Returns the chunk at chunk_pos, calling create() to make it if there is none yet.
+    // The second value is true if this call inserted the chunk.
+    template<typename F>
+    std::pair<Chunk*, bool> find_or_insert(i32vec3 chunk_pos, F &&create) {
+        auto &s = shard(chunk_pos);
+        {
+            std::shared_lock guard(s.mutex);
+            auto it = s.chunks.find(chunk_pos);
+            if (it != s.chunks.end())
+                return { it->second, false };
+        }
+
+        std::scoped_lock guard(s.mutex);
+        auto [it, inserted] = s.chunks.try_emplace(chunk_pos, nullptr);
+        if (inserted)
+            it->second = create();
+        return { it->second, inserted };
+    }
+
+    void set(i32vec3 chunk_pos, Chunk *chunk) {
+        auto &s = shard(chunk_pos);
+        std::scoped_lock guard(s.mutex);
+        if (chunk)
+            s.chunks[chunk_pos] = chunk;
+        else
+            s.chunks.erase(chunk_pos);
+    }
+
+    // Swaps in desired only if the chunk at chunk_pos is still expected
+    bool replace(i32vec3 chunk_pos, Chunk *expected, Chunk *desired) {
+        auto &s = shard(chunk_pos);
+        std::scoped_lock guard(s.mutex);
+        auto it = s.chunks.find(chunk_pos);
+        if (it == s.chunks.end() || it->second != expected)
+            return false;
+        it->second = desired;
+        return true;
+    }
+
+    Chunk* erase(i32vec3 chunk_pos) {
+        auto &s = shard(chunk_pos);
+        std::scoped_lock guard(s.mutex);
+        auto it = s.chunks.find(chunk_pos);
+        if (it == s.chunks.end())
+            return nullptr;
+        Chunk *chunk = it->second;
+        s.chunks.erase(it);
+        return chunk;
+    }
+
+    usize size() {
+        usize total = 0;
+        for (auto &s : m_shards) {
+            std::shared_lock guard(s.mutex);
+            total += s.chunks.size();
+        }
+        return total;
+    }
+
+    // Locks one shard at a time, the function must not call back into the map
+    template<typename F>
+    void for_each(F &&function) {
+        for (auto &s : m_shards) {
+            std::shared_lock guard(s.mutex);
+            for (auto &[chunk_pos, chunk] : s.chunks)
+                function(chunk_pos, chunk);
+        }
+    }
+};
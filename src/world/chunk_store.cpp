@@ -0,0 +1,77 @@
+#include "chunk_store.hpp"
+#include "chunk_codec.hpp"
+
+ChunkStore::ChunkStore(const std::filesystem::path &directory) : m_regions(directory), m_wake_up(0) {
+    m_running.test_and_set();
+    m_thread = std::thread([this] {
+        auto last_sync = std::chrono::steady_clock::now();
+        while (m_running.test()) {
+            // wait a little so a burst of changes ends up in one batch
+            m_wake_up.try_acquire_for(std::chrono::milliseconds(250));
+            write_pending();
+
+            auto now = std::chrono::steady_clock::now();
+            if (now - last_sync >= sync_interval) {
+                m_regions.flush();
+                last_sync = now;
+            }
+        }
+    });
+}
+
+ChunkStore::~ChunkStore() {
+    m_running.clear();
+    m_wake_up.release();
+    m_thread.join();
+    flush();
+}
+
+void ChunkStore::save(i32vec3 chunk_pos, std::vector<u8> &&payload) {
+    auto shared = std::make_shared<const std::vector<u8>>(std::move(payload));
+    std::scoped_lock guard(m_pending_mutex);
+    m_pending[chunk_pos] = std::move(shared);
+}
+
+bool ChunkStore::load(i32vec3 chunk_pos, std::vector<u8> &payload) {
+    {
+        std::scoped_lock guard(m_pending_mutex);
+        auto it = m_pending.find(chunk_pos);
+        if (it != m_pending.end()) {
+            payload = *it->second;
+            return true;
+        }
+    }
+    return m_regions.load(chunk_pos, payload);
+}
+
+void ChunkStore::flush() {
+    write_pending();
+    m_regions.flush();
+}
+
+void ChunkStore::write_pending() {
+    std::scoped_lock write_guard(m_write_mutex);
+
+    // payloads stay pending while they are written, so loads in the meantime still find them
+    std::vector<std::pair<i32vec3, Payload>> batch;
+    {
+        std::scoped_lock guard(m_pending_mutex);
+        batch.assign(m_pending.begin(), m_pending.end());
+    }
+    if (batch.empty())
+        return;
+
+    std::vector<std::pair<i32vec3, const std::vector<u8>*>> chunks;
+    chunks.reserve(batch.size());
+    for (auto &[chunk_pos, payload] : batch)
+        chunks.emplace_back(chunk_pos, payload.get());
+    m_regions.save_batch(chunks, chunk_codec::current_dictionary_id());
+
+    // drop what was written, unless a newer payload replaced it in the meantime
+    std::scoped_lock guard(m_pending_mutex);
+    for (auto &[chunk_pos, payload] : batch) {
+        auto it = m_pending.find(chunk_pos);
+        if (it != m_pending.end() && it->second == payload)
+            m_pending.erase(it);
+    }
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <semaphore>
+
+#include "region_file.hpp"
+
+// Persists serialized chunks on a background thread. Payloads wait in memory until the thread
+// writes them out in batches, loads see those pending payloads before the region files.
+// Regions are fsynced at most every sync_interval, and once more on destruction.
+class ChunkStore {
+public:
+    static constexpr auto sync_interval = std::chrono::seconds(5);
+
+    ChunkStore(const std::filesystem::path &directory);
+    ~ChunkStore();
+    ChunkStore(const ChunkStore &other) = delete;
+
+    // Never touches the disk, the newest payload for a position replaces any older pending one
+    void save(i32vec3 chunk_pos, std::vector<u8> &&payload);
+    bool load(i32vec3 chunk_pos, std::vector<u8> &payload);
+    // Writes everything pending and fsyncs, blocking until done
+    void flush();
+
+    inline usize num_pending() {
+        std::scoped_lock guard(m_pending_mutex);
+        return m_pending.size();
+    }
+
+private:
+    using Payload = std::shared_ptr<const std::vector<u8>>;
+
+    RegionStore m_regions;
+    std::mutex m_pending_mutex;
+    std::unordered_map<i32vec3, Payload> m_pending;
+
+    std::mutex m_write_mutex; // only one batch gets written at a time
+    std::thread m_thread;
+    std::binary_semaphore m_wake_up;
+    std::atomic_flag m_running = ATOMIC_FLAG_INIT;
+
+    void write_pending();
+};
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <bit>
+#include <array>
+#include <vector>
+#include <memory>
+#include <shared_mutex>
+#include <unordered_map>
+#define GLM_ENABLE_EXPERIMENTAL
+#include <glm/gtx/hash.hpp>
+
+#include "chunk.hpp"
+
+// What generation computes once per column of chunks (same chunk x and z) instead of once per
+// chunk and stage. Sharded like ChunkMap, columns are handed out as shared pointers so an
+// evicted one stays valid for whoever is still generating with it.
+class ColumnCache {
+public:
+    static constexpr usize num_shards = 64;
+    static_assert(std::has_single_bit(num_shards));
+
+    // Something decoration places across chunk borders. It only depends on the column it is
+    // rooted in, so every chunk it overlaps places its own part of it when it is decorated.
+    struct Structure {
+        enum class Type : u8 {
+            TREE,
+        };
+
+        Type type;
+        i32vec3 origin;
+        i32vec3 min, max; // inclusive world space bounds
+    };
+
+    struct Column {
+        std::array<i32, Chunk::area> heights; // terrain height in blocks, z * size + x like the noise grid
+        i32 min_height, max_height;
+        std::array<u8, Chunk::area> decoration; // what grows on top of the terrain, a roll out of 100
+        std::vector<Structure> structures; // rooted in this column
+    };
+
+private:
+    struct alignas(64) Shard {
+        std::shared_mutex mutex;
+        std::unordered_map<i32vec2, std::shared_ptr<const Column>> columns;
+    };
+
+    std::array<Shard, num_shards> m_shards;
+
+    static usize shard_index(i32vec2 column_pos) {
+        u64 hash = std::hash<i32vec2>()(column_pos) * 0x9E3779B97F4A7C15ull;
+        return hash >> (64 - std::countr_zero(num_shards));
+    }
+
+    Shard& shard(i32vec2 column_pos) {
+        return m_shards[shard_index(column_pos)];
+    }
+
+public:
+    std::shared_ptr<const Column> find(i32vec2 column_pos) {
+        auto &s = shard(column_pos);
+        std::shared_lock guard(s.mutex);
+        auto it = s.columns.find(column_pos);
+        return it != s.columns.end() ? it->second : nullptr;
+    }
+
+    // Keeps the column that is already there if two threads generated the same one, returns the cached one
+    std::shared_ptr<const Column> insert(i32vec2 column_pos, std::shared_ptr<const Column> column) {
+        auto &s = shard(column_pos);
+        std::scoped_lock guard(s.mutex);
+        return s.columns.try_emplace(column_pos, std::move(column)).first->second;
+    }
+
+    // Drops every column pred(column_pos) returns true for
+    template<typename F>
+    usize evict_if(F &&pred) {
+        usize num_evicted = 0;
+        for (auto &s : m_shards) {
+            std::scoped_lock guard(s.mutex);
+            num_evicted += std::erase_if(s.columns, [&] (auto &entry) { return pred(entry.first); });
+        }
+        return num_evicted;
+    }
+
+    usize size() {
+        usize total = 0;
+        for (auto &s : m_shards) {
+            std::shared_lock guard(s.mutex);
+            total += s.columns.size();
+        }
+        return total;
+    }
+};
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <array>
+
+#include "../util.hpp"
+
+// Noise sampled every factor blocks and interpolated in between, for noise that doesn't need
+// full resolution. Grids are in FastNoise order, x fastest, then y, then z.
+namespace noise_upsample {
+    template<i32 size, i32 factor>
+    constexpr i32 coarse_size = size / factor + 1;
+
+    // Bilinearly interpolates a coarse_size^2 grid, whose rows are stride values apart, up to size^2.
+    // Each value is (a * (factor - i) + b * i) / factor along x, then the same along z, which for
+    // a factor of 2 is exactly the pairwise averages heightmaps have always been built from. Both
+    // passes are plain loops over contiguous rows the compiler turns into SIMD.
+    template<i32 size, i32 factor>
+    void bilinear(const f32 *coarse, i32 stride, f32 *out) {
+        static_assert(size % factor == 0);
+        constexpr i32 n = coarse_size<size, factor>;
+
+        // along x, for every coarse row
+        std::array<f32, n * size> rows_x;
+        for (i32 row = 0; row < n; row++) {
+            const f32 *in = &coarse[row * stride];
+            f32 *expanded = &rows_x[row * size];
+            for (i32 cell = 0; cell < n - 1; cell++)
+                for (i32 i = 0; i < factor; i++)
+                    expanded[cell * factor + i] = (in[cell] * (f32)(factor - i) + in[cell + 1] * (f32)i) / (f32)factor;
+        }
+
+        // along z, a whole row at a time
+        for (i32 z = 0; z < size; z++) {
+            const f32 *a = &rows_x[(z / factor) * size];
+            const f32 *b = a + size;
+            f32 wa = (f32)(factor - z % factor), wb = (f32)(z % factor);
+            f32 *out_row = &out[z * size];
+            for (i32 x = 0; x < size; x++)
+                out_row[x] = (a[x] * wa + b[x] * wb) / (f32)factor;
+        }
+    }
+
+    // Trilinearly interpolates a coarse_size^3 grid up to size^3. Done one axis at a time, each
+    // pass a plain loop over contiguous rows the compiler turns into SIMD.
+    template<i32 size, i32 factor>
+    void trilinear(const f32 *coarse, f32 *out) {
+        static_assert(size % factor == 0);
+        constexpr i32 n = coarse_size<size, factor>;
+        constexpr f32 step = 1.0f / factor;
+
+        // along x, for every coarse row
+        std::array<f32, n * n * size> rows_x;
+        for (i32 row = 0; row < n * n; row++) {
+            const f32 *in = &coarse[row * n];
+            f32 *expanded = &rows_x[row * size];
+            for (i32 cell = 0; cell < n - 1; cell++)
+                for (i32 i = 0; i < factor; i++)
+                    expanded[cell * factor + i] = in[cell] + (in[cell + 1] - in[cell]) * (i * step);
+        }
+
+        // along y, giving full planes at every coarse z
+        std::array<f32, n * size * size> planes;
+        for (i32 cz = 0; cz < n; cz++) {
+            for (i32 y = 0; y < size; y++) {
+                const f32 *a = &rows_x[(cz * n + y / factor) * size];
+                const f32 *b = a + size;
+                f32 t = (y % factor) * step;
+                f32 *plane_row = &planes[(cz * size + y) * size];
+                for (i32 x = 0; x < size; x++)
+                    plane_row[x] = a[x] + (b[x] - a[x]) * t;
+            }
+        }
+
+        // along z, a whole plane at a time
+        for (i32 z = 0; z < size; z++) {
+            const f32 *a = &planes[(z / factor) * size * size];
+            const f32 *b = a + size * size;
+            f32 t = (z % factor) * step;
+            f32 *out_plane = &out[z * size * size];
+            for (i32 i = 0; i < size * size; i++)
+                out_plane[i] = a[i] + (b[i] - a[i]) * t;
+        }
+    }
+}
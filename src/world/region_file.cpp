@@ -0,0 +1,333 @@
+#include "region_file.hpp"
+
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static bool read_fully(int fd, void *data, usize size, u64 offset) {
+    while (size > 0) {
+        ssize_t num = pread(fd, data, size, offset);
+        if (num <= 0)
+            return false;
+        data = (u8*)data + num;
+        size -= num;
+        offset += num;
+    }
+    return true;
+}
+
+static bool write_fully(int fd, const void *data, usize size, u64 offset) {
+    while (size > 0) {
+        ssize_t num = pwrite(fd, data, size, offset);
+        if (num <= 0)
+            return false;
+        data = (const u8*)data + num;
+        size -= num;
+        offset += num;
+    }
+    return true;
+}
+
+static uint entry_index(i32vec3 local_pos) {
+    return coords_to_index<RegionFile::size>(local_pos.x, local_pos.y, local_pos.z);
+}
+
+RegionFile::RegionFile(const std::filesystem::path &path, bool create) : m_header(std::make_unique<Header>()) {
+    m_fd = open(path.c_str(), O_RDWR | (create ? O_CREAT : 0), 0644);
+    if (m_fd == -1)
+        return;
+
+    struct stat file_stat;
+    fstat(m_fd, &file_stat);
+    if (file_stat.st_size != 0 || !create) {
+        if ((usize)file_stat.st_size >= sizeof(Header) && read_fully(m_fd, m_header.get(), sizeof(Header), 0)
+            && m_header->magic == magic && m_header->version == version) {
+            m_end = file_stat.st_size;
+            // whatever no entry points at is left over from payloads replaced before
+            std::vector<std::pair<u64, u64>> used;
+            for (const Entry &entry : m_header->entries)
+                if (entry.offset >= sizeof(Header) && entry.offset + entry.length <= m_end)
+                    used.emplace_back(entry.offset, entry.length);
+            std::sort(used.begin(), used.end());
+            u64 free_start = sizeof(Header);
+            for (auto [offset, length] : used) {
+                if (offset > free_start)
+                    release(free_start, offset - free_start);
+                free_start = std::max(free_start, offset + length);
+            }
+            if (m_end > free_start)
+                release(free_start, m_end - free_start);
+            return;
+        }
+
+        log(LogLevel::ERROR, "RegionFile", "{} is not a region file this version can read", path);
+        close(m_fd);
+        m_fd = -1;
+        if (!create)
+            return;
+        // keep the old file around, but don't let it stop new chunks from being saved
+        auto incompatible_path = path;
+        incompatible_path += ".incompatible";
+        std::error_code error;
+        std::filesystem::rename(path, incompatible_path, error);
+        m_fd = error ? -1 : open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (m_fd == -1)
+            return;
+    }
+
+    // fresh file, write an empty header
+    std::memset(m_header.get(), 0, sizeof(Header));
+    m_header->magic = magic;
+    m_header->version = version;
+    write_fully(m_fd, m_header.get(), sizeof(Header), 0);
+    m_end = sizeof(Header);
+}
+
+RegionFile::~RegionFile() {
+    if (m_fd == -1)
+        return;
+    sync(); // the header entries written since the last one only live in memory
+    close(m_fd);
+}
+
+u32 RegionFile::dictionary_id() {
+    std::scoped_lock guard(m_mutex);
+    return m_header->dictionary_id;
+}
+
+bool RegionFile::has(i32vec3 local_pos) {
+    std::scoped_lock guard(m_mutex);
+    return m_header->entries[entry_index(local_pos)].offset != 0;
+}
+
+bool RegionFile::read(i32vec3 local_pos, std::vector<u8> &payload) {
+    std::shared_lock read_guard(m_read_mutex);
+    Entry entry;
+    u64 end;
+    {
+        std::scoped_lock guard(m_mutex);
+        entry = m_header->entries[entry_index(local_pos)];
+        end = m_end;
+    }
+    if (entry.offset == 0)
+        return false;
+    if (entry.offset < sizeof(Header) || entry.length > max_payload_size || entry.offset + entry.length > end) {
+        log(LogLevel::ERROR, "RegionFile", "Header entry for chunk at {} points outside the file", local_pos);
+        return false;
+    }
+
+    payload.resize(entry.length);
+    if (!read_fully(m_fd, payload.data(), entry.length, entry.offset)) {
+        log(LogLevel::ERROR, "RegionFile", "Failed to read chunk at {}", local_pos);
+        return false;
+    }
+    return true;
+}
+
+void RegionFile::write(i32vec3 local_pos, const u8 *payload, u32 length, u32 dictionary_id) {
+    write_batch({ Write { local_pos, payload, length } }, dictionary_id);
+}
+
+u64 RegionFile::allocate(u32 length) {
+    // first fit, chunk payloads are all about the same size
+    for (auto it = m_free.begin(); it != m_free.end(); it++) {
+        auto [offset, free_length] = *it;
+        if (free_length < length)
+            continue;
+        m_free.erase(it);
+        if (free_length > length)
+            m_free.emplace(offset + length, free_length - length);
+        return offset;
+    }
+    u64 offset = m_end;
+    m_end += length;
+    return offset;
+}
+
+void RegionFile::release(u64 offset, u64 length) {
+    if (length == 0)
+        return;
+    auto next = m_free.lower_bound(offset);
+    if (next != m_free.end() && offset + length == next->first) {
+        length += next->second;
+        next = m_free.erase(next);
+    }
+    if (next != m_free.begin()) {
+        auto previous = std::prev(next);
+        if (previous->first + previous->second == offset) {
+            previous->second += length;
+            return;
+        }
+    }
+    m_free.emplace(offset, length);
+}
+
+void RegionFile::write_batch(const std::vector<Write> &writes, u32 dictionary_id) {
+    if (writes.empty())
+        return;
+
+    std::vector<std::pair<u64, const Write*>> placed;
+    placed.reserve(writes.size());
+    {
+        std::scoped_lock guard(m_mutex);
+        for (auto &write : writes)
+            placed.emplace_back(allocate(write.length), &write);
+    }
+
+    // payloads that ended up next to each other go out with one pwrite
+    std::sort(placed.begin(), placed.end(), [] (auto &a, auto &b) { return a.first < b.first; });
+    bool written = true;
+    std::vector<u8> run;
+    for (usize i = 0; i < placed.size() && written;) {
+        u64 run_offset = placed[i].first;
+        run.clear();
+        for (; i < placed.size() && placed[i].first == run_offset + run.size(); i++)
+            run.insert(run.end(), placed[i].second->payload, placed[i].second->payload + placed[i].second->length);
+        written = write_fully(m_fd, run.data(), run.size(), run_offset);
+    }
+
+    std::scoped_lock guard(m_mutex);
+    if (!written) {
+        log(LogLevel::ERROR, "RegionFile", "Failed to write {} chunks", writes.size());
+        for (auto [offset, write] : placed)
+            release(offset, write->length);
+        return;
+    }
+    for (auto [offset, write] : placed) {
+        uint index = entry_index(write->local_pos);
+        Entry &entry = m_header->entries[index];
+        if (entry.offset != 0)
+            m_replaced.emplace_back(entry.offset, entry.length);
+        entry = { offset, write->length, 0 };
+        m_dirty_first = std::min(m_dirty_first, index);
+        m_dirty_last = std::max(m_dirty_last, index);
+    }
+    if (m_header->dictionary_id != dictionary_id) {
+        m_header->dictionary_id = dictionary_id;
+        m_dictionary_dirty = true;
+    }
+}
+
+void RegionFile::sync() {
+    std::scoped_lock sync_guard(m_sync_mutex);
+
+    // every payload these entries point at was written before they were changed
+    std::vector<Entry> entries;
+    uint first;
+    u32 dictionary_id;
+    bool dictionary_dirty;
+    std::vector<std::pair<u64, u64>> replaced;
+    {
+        std::scoped_lock guard(m_mutex);
+        first = m_dirty_first;
+        if (m_dirty_first <= m_dirty_last)
+            entries.assign(&m_header->entries[m_dirty_first], &m_header->entries[m_dirty_last] + 1);
+        dictionary_id = m_header->dictionary_id;
+        dictionary_dirty = m_dictionary_dirty;
+        m_dirty_first = volume;
+        m_dirty_last = 0;
+        m_dictionary_dirty = false;
+        replaced.swap(m_replaced);
+    }
+    if (entries.empty() && !dictionary_dirty)
+        return; // nothing was written since the last sync
+
+    // the payloads have to be on disk before any header entry points at them
+    bool synced = fdatasync(m_fd) == 0;
+    // entries in between are unchanged, rewriting them is cheaper than a pwrite each
+    if (synced && !entries.empty())
+        synced = write_fully(m_fd, entries.data(), entries.size() * sizeof(Entry), offsetof(Header, entries) + first * sizeof(Entry));
+    if (synced && dictionary_dirty)
+        synced = write_fully(m_fd, &dictionary_id, sizeof(u32), offsetof(Header, dictionary_id));
+    if (synced)
+        synced = fdatasync(m_fd) == 0;
+    if (!synced) {
+        // the header on disk may be anywhere in between, keep everything for the next try
+        log(LogLevel::ERROR, "RegionFile", "Failed to sync {} header entries", entries.size());
+        std::scoped_lock guard(m_mutex);
+        if (!entries.empty()) {
+            m_dirty_first = std::min<uint>(m_dirty_first, first);
+            m_dirty_last = std::max<uint>(m_dirty_last, first + entries.size() - 1);
+        }
+        m_dictionary_dirty |= dictionary_dirty;
+        m_replaced.insert(m_replaced.end(), replaced.begin(), replaced.end());
+        return;
+    }
+
+    std::scoped_lock read_guard(m_read_mutex);
+    std::scoped_lock guard(m_mutex);
+    for (auto [offset, length] : replaced)
+        release(offset, length);
+}
+
+RegionStore::RegionStore(const std::filesystem::path &directory) : m_directory(directory) {
+    std::filesystem::create_directories(directory);
+}
+
+RegionFile* RegionStore::region(i32vec3 region_pos, bool create) {
+    std::scoped_lock guard(m_mutex);
+    auto it = m_regions.find(region_pos);
+    if (it != m_regions.end() && (it->second || !create))
+        return it->second.get();
+
+    std::string name = "r." + std::to_string(region_pos.x) + "." + std::to_string(region_pos.y) + "." + std::to_string(region_pos.z) + ".vkr";
+    auto path = m_directory / name;
+    std::unique_ptr<RegionFile> file;
+    if (create || std::filesystem::exists(path)) {
+        file = std::make_unique<RegionFile>(path, create);
+        if (!file->is_open())
+            file.reset();
+    }
+    auto &region = m_regions[region_pos];
+    region = std::move(file);
+    return region.get();
+}
+
+bool RegionStore::load(i32vec3 chunk_pos, std::vector<u8> &payload) {
+    auto [region_pos, local_pos] = signed_i32vec3_divide(chunk_pos, RegionFile::size);
+    RegionFile *file = region(region_pos, false);
+    return file && file->read(local_pos, payload);
+}
+
+void RegionStore::save(i32vec3 chunk_pos, const u8 *payload, u32 length, u32 dictionary_id) {
+    auto [region_pos, local_pos] = signed_i32vec3_divide(chunk_pos, RegionFile::size);
+    RegionFile *file = region(region_pos, true);
+    if (!file)
+        return;
+    file->write(local_pos, payload, length, dictionary_id);
+
+    std::scoped_lock guard(m_mutex);
+    if (std::find(m_unsynced.begin(), m_unsynced.end(), file) == m_unsynced.end())
+        m_unsynced.push_back(file);
+}
+
+void RegionStore::save_batch(const std::vector<std::pair<i32vec3, const std::vector<u8>*>> &chunks, u32 dictionary_id) {
+    std::unordered_map<i32vec3, std::vector<RegionFile::Write>> by_region;
+    for (auto &[chunk_pos, payload] : chunks) {
+        auto [region_pos, local_pos] = signed_i32vec3_divide(chunk_pos, RegionFile::size);
+        by_region[region_pos].push_back({ local_pos, payload->data(), (u32)payload->size() });
+    }
+
+    for (auto &[region_pos, writes] : by_region) {
+        RegionFile *file = region(region_pos, true);
+        if (!file)
+            continue;
+        file->write_batch(writes, dictionary_id);
+
+        std::scoped_lock guard(m_mutex);
+        if (std::find(m_unsynced.begin(), m_unsynced.end(), file) == m_unsynced.end())
+            m_unsynced.push_back(file);
+    }
+}
+
+void RegionStore::flush() {
+    std::vector<RegionFile*> unsynced;
+    {
+        std::scoped_lock guard(m_mutex);
+        unsynced.swap(m_unsynced);
+    }
+    for (RegionFile *file : unsynced)
+        file->sync();
+}
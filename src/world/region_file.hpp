@@ -0,0 +1,109 @@
+#pragma once
+
+#include <map>
+#include <array>
+#include <mutex>
+#include <memory>
+#include <shared_mutex>
+#include <vector>
+#include <filesystem>
+#include <unordered_map>
+#define GLM_ENABLE_EXPERIMENTAL
+#include <glm/gtx/hash.hpp>
+
+#include "../util.hpp"
+
+// A region stores size^3 chunks in one file: a fixed header with the offset and length of every
+// chunk, followed by the chunk payloads. Rewriting a chunk puts the new payload into free space
+// and points its header entry at it. Header entries only reach the disk on sync, after the
+// payloads they point at, and the space of a replaced payload only gets reused once the header
+// on disk no longer points at it, so a crash leaves every chunk at its old or its new payload.
+class RegionFile {
+public:
+    static constexpr i32 size = 16;
+    static constexpr i32 volume = size * size * size;
+    static constexpr u32 magic = 0x47524B56; // "VKRG"
+    static constexpr u32 version = 2;
+    // far beyond any chunk payload, a longer entry can only come from a damaged header
+    static constexpr u32 max_payload_size = 1 << 20;
+
+    struct Entry {
+        u64 offset; // 0 if the chunk was never written
+        u32 length;
+        u32 padding;
+    };
+
+    struct Write {
+        i32vec3 local_pos;
+        const u8 *payload;
+        u32 length;
+    };
+
+    struct Header {
+        u32 magic;
+        u32 version;
+        u32 dictionary_id; // the compression dictionary payloads were last written with, 0 for none
+        u32 padding;
+        std::array<Entry, volume> entries;
+    };
+
+    // Opens the region file at path, creating it first if create is set. With create, a file
+    // this version can't read is moved aside to <path>.incompatible and replaced, without it
+    // the region just fails to open.
+    RegionFile(const std::filesystem::path &path, bool create);
+    ~RegionFile();
+    RegionFile(const RegionFile &other) = delete;
+
+    inline bool is_open() const { return m_fd != -1; }
+    u32 dictionary_id();
+
+    bool has(i32vec3 local_pos);
+    // Reads a chunk payload with a single pread, returns false if the chunk is not stored
+    bool read(i32vec3 local_pos, std::vector<u8> &payload);
+    void write(i32vec3 local_pos, const u8 *payload, u32 length, u32 dictionary_id = 0);
+    // Writes the payloads into free space, one pwrite per contiguous run, and points the header
+    // entries in memory at them. Neither is synced, that is up to sync.
+    void write_batch(const std::vector<Write> &writes, u32 dictionary_id = 0);
+    // fdatasyncs the payloads written so far, then writes the header entries pointing at them
+    // and syncs again. Space of the payloads they replaced becomes free after that.
+    void sync();
+
+private:
+    int m_fd = -1;
+    std::mutex m_mutex; // guards the header, m_end and the free space, the file itself is only accessed with pread/pwrite
+    std::mutex m_sync_mutex; // the header on disk has to be written in the order of the snapshots taken
+    std::shared_mutex m_read_mutex; // held by reads until their pread is done, so freed space isn't reused under them
+    std::unique_ptr<Header> m_header;
+    u64 m_end;
+
+    std::map<u64, u64> m_free; // offset -> length, adjacent ranges are merged
+    // payloads replaced since the last sync, the header on disk may still point at them
+    std::vector<std::pair<u64, u64>> m_replaced;
+    uint m_dirty_first = volume, m_dirty_last = 0; // header entries that changed since the last sync
+    bool m_dictionary_dirty = false;
+
+    u64 allocate(u32 length);
+    void release(u64 offset, u64 length);
+};
+
+// All region files of a world, opened on first use and kept open
+class RegionStore {
+public:
+    RegionStore(const std::filesystem::path &directory);
+
+    bool load(i32vec3 chunk_pos, std::vector<u8> &payload);
+    void save(i32vec3 chunk_pos, const u8 *payload, u32 length, u32 dictionary_id = 0);
+    // Like save, but one batched write per region touched
+    void save_batch(const std::vector<std::pair<i32vec3, const std::vector<u8>*>> &chunks, u32 dictionary_id = 0);
+    // syncs every region written to since the last flush, chunks saved before are only safe after it
+    void flush();
+
+private:
+    std::filesystem::path m_directory;
+    std::mutex m_mutex;
+    // regions without a file are remembered as nullptr, so lookups in untouched space don't hit the disk
+    std::unordered_map<i32vec3, std::unique_ptr<RegionFile>> m_regions;
+    std::vector<RegionFile*> m_unsynced;
+
+    RegionFile* region(i32vec3 region_pos, bool create);
+};
@@ -0,0 +1,127 @@
+#include "storage_dedup.hpp"
+
+#include <mutex>
+#include <array>
+#include <atomic>
+#include <vector>
+#include <unordered_map>
+
+namespace storage_dedup {
+    static std::atomic<usize> num_references = 0, num_payloads = 0;
+
+    // a storage lives in the shard its content hash picks, so workers sharing different contents
+    // don't wait on each other
+    static constexpr usize num_shards = 64;
+
+    template<typename T>
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_multimap<u64, PaletteStorage<T>*> by_hash;
+        std::unordered_map<PaletteStorage<T>*, u32> ref_counts;
+
+        void remove(PaletteStorage<T> *storage, u64 hash) {
+            auto [begin, end] = by_hash.equal_range(hash);
+            for (auto it = begin; it != end; it++) {
+                if (it->second == storage) {
+                    by_hash.erase(it);
+                    break;
+                }
+            }
+            ref_counts.erase(storage);
+            num_payloads--;
+        }
+    };
+
+    // function-local so it is ready even for chunks created during static init
+    template<typename T>
+    static Shard<T>& shard(u64 hash) {
+        static std::array<Shard<T>, num_shards> shards;
+        return shards[(hash >> 32) % num_shards];
+    }
+
+    template<typename T>
+    PaletteStorage<T>* share(PaletteStorage<T> *storage, u64 &hash) {
+        // hashing only reads the storage, so it happens before taking the lock. The storages
+        // with the same hash are compared under it, one of them may be going away otherwise.
+        hash = storage->content_hash();
+        auto &t = shard<T>(hash);
+        std::scoped_lock guard(t.mutex);
+        num_references++;
+
+        auto [begin, end] = t.by_hash.equal_range(hash);
+        for (auto it = begin; it != end; it++) {
+            if (it->second->same_content(*storage)) {
+                t.ref_counts[it->second]++;
+                delete storage;
+                return it->second;
+            }
+        }
+
+        t.by_hash.emplace(hash, storage);
+        t.ref_counts.emplace(storage, 1);
+        num_payloads++;
+        return storage;
+    }
+
+    template<typename T>
+    void retain(PaletteStorage<T> *storage, u64 hash) {
+        auto &t = shard<T>(hash);
+        std::scoped_lock guard(t.mutex);
+        num_references++;
+        t.ref_counts.at(storage)++;
+    }
+
+    template<typename T>
+    PaletteStorage<T>* unshare(PaletteStorage<T> *storage, u64 hash) {
+        auto &t = shard<T>(hash);
+        {
+            std::scoped_lock guard(t.mutex);
+            num_references--;
+            auto &ref_count = t.ref_counts.at(storage);
+            if (ref_count == 1) {
+                // nobody else is looking at it, so it can simply be taken back
+                t.remove(storage, hash);
+                return storage;
+            }
+            // the caller keeps its reference until the copy is made, so it can't be freed under us
+        }
+
+        auto *copy = new PaletteStorage<T>(storage->m_size);
+        std::vector<T> values(storage->m_size);
+        storage->get_all(values.data());
+        copy->set_all(values.data());
+
+        std::scoped_lock guard(t.mutex);
+        auto &ref_count = t.ref_counts.at(storage);
+        if (--ref_count == 0) {
+            t.remove(storage, hash);
+            delete storage;
+        }
+        return copy;
+    }
+
+    template<typename T>
+    void release(PaletteStorage<T> *storage, u64 hash) {
+        auto &t = shard<T>(hash);
+        std::scoped_lock guard(t.mutex);
+        num_references--;
+        auto &ref_count = t.ref_counts.at(storage);
+        if (--ref_count == 0) {
+            t.remove(storage, hash);
+            delete storage;
+        }
+    }
+
+    Stats stats() {
+        return { num_references.load(), num_payloads.load() };
+    }
+
+    template PaletteStorage<BlockNID>* share(PaletteStorage<BlockNID>*, u64&);
+    template void retain(PaletteStorage<BlockNID>*, u64);
+    template PaletteStorage<BlockNID>* unshare(PaletteStorage<BlockNID>*, u64);
+    template void release(PaletteStorage<BlockNID>*, u64);
+    template PaletteStorage<u16>* share(PaletteStorage<u16>*, u64&);
+    template void retain(PaletteStorage<u16>*, u64);
+    template PaletteStorage<u16>* unshare(PaletteStorage<u16>*, u64);
+    template void release(PaletteStorage<u16>*, u64);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "block_storage.hpp"
+
+// Chunks with identical contents (all stone, all air, all water, ...) point at one shared
+// storage instead of each keeping a copy. Shared storages are read-only, a chunk gets its
+// own copy back with unshare() before writing.
+namespace storage_dedup {
+    struct Stats {
+        usize references; // chunk storages pointing at a shared storage
+        usize payloads;   // distinct shared storages
+    };
+
+    // Takes ownership of storage and returns the shared storage with the same contents,
+    // which is storage itself if nothing identical was shared yet. hash gets the content hash
+    // it is filed under, which the other two take so they don't have to hash it again.
+    template<typename T> PaletteStorage<T>* share(PaletteStorage<T> *storage, u64 &hash);
+    // Adds a reference to a storage that is already shared
+    template<typename T> void retain(PaletteStorage<T> *storage, u64 hash);
+    // Drops a reference to a shared storage and returns a private one with the same contents
+    template<typename T> PaletteStorage<T>* unshare(PaletteStorage<T> *storage, u64 hash);
+    // Drops a reference to a shared storage, freeing it with the last one
+    template<typename T> void release(PaletteStorage<T> *storage, u64 hash);
+
+    Stats stats();
+}
@@ -1,14 +1,20 @@
 #include "world.hpp"
 #include "chunk.hpp"
+#include "chunk_codec.hpp"
+#include "../game.hpp"
 #include "../parallel_executor.hpp"
 #include "../renderer/chunk_renderer.hpp"
 
+#include <algorithm>
 #include <filesystem>
 #include <fstream>
 #include <entt/entt.hpp>
 
-World::World() {
+World::World() : World(std::filesystem::path("worlds") / "testing") {}
+
+World::World(const std::filesystem::path &directory) : m_chunk_store(directory) {
     m_seed = 1337;
+    chunk_codec::load_dictionaries(directory / "dictionaries");
 
     m_simplex_noise = FastNoise::New<FastNoise::Simplex>();
 
@@ -26,104 +32,155 @@ World::World() {
     m_max_smooth->SetRHS(m_fractal_noise);
 
     m_cave_noise = FastNoise::New<FastNoise::Simplex>();
-
-    // std::filesystem::path world_dir("worlds");
-    // world_dir /= "testing";
-    // log(LogLevel::INFO, "World", "Loading world from {}...", world_dir);
-    // if (std::filesystem::is_regular_file(world_dir / "chunks")) {
-    //     std::ifstream input(world_dir / "chunks", std::ios::binary);
-    //     usize original_size = 0;
-    //     input.read((char*)&original_size, sizeof(original_size));
-    //     std::vector<u8> compressed(std::istreambuf_iterator<char>(input), {});
-    //     SerialBuffer buffer = SerialBuffer::decompress(compressed, original_size);
-    //     int num_chunks = 0;
-    //     buffer.pop(num_chunks);
-    //     for (int i = 0; i < num_chunks; i++) {
-    //         i32vec3 chunk_pos;
-    //         buffer.pop(chunk_pos);
-    //         Chunk *chunk = new Chunk(chunk_pos);
-    //         chunk->deserialize(buffer);
-    //         m_chunk_map[chunk_pos] = chunk;
-    //         chunk->m_decorated.test_and_set();
-    //         chunk->m_will_save.test_and_set();
-    //         m_chunks_to_save.enqueue(chunk);
-    //         mark_chunk_mesh_dirty(chunk_pos);
-    //     }
-    //     log(LogLevel::INFO, "World", "World successfully loaded");
-    // } else {
-    //     log(LogLevel::ERROR, "World", "Failed to load world due to it not existing");
-    //     log(LogLevel::WARN, "World", "Creating new world instead");
-    // }
 }
 
 World::~World() {
-    // log(LogLevel::INFO, "World", "Saving world...");
-    // std::filesystem::path world_dir("worlds");
-    // world_dir /= "testing";
-    // std::filesystem::create_directories(world_dir);
-    // std::ofstream output(world_dir / "chunks", std::ios::binary | std::ios::trunc);
-
-    // SerialBuffer buffer;
-    // int num_chunks = 0;
-    // Chunk *chunk;
-    // while (m_chunks_to_save.try_dequeue(chunk)) {
-    //     if (!chunk)
-    //         continue;
-    //     chunk->serialize(buffer);
-    //     buffer.push(chunk->m_chunk_pos);
-    //     num_chunks++;
-    // }
-    // buffer.push(num_chunks);
-    // usize original_size = buffer.size();
-    // output.write((const char*)&original_size, sizeof(original_size));
-    // auto compressed = buffer.compress();
-    // output.write((const char*)compressed.data(), compressed.size());
-    // output.close();
-
-    // log(LogLevel::INFO, "World", "Saved world to {} ({} chunks -> {} MiB)", world_dir, num_chunks, ((double)compressed.size() / 1024.0) / 1024.0);
-
-    for (auto [chunk_pos, chunk] : m_chunk_map)
+    // everything else was already handed to the chunk store by save_chunks
+    usize num_saved = 0;
+    m_chunk_map.for_each([&] (i32vec3, Chunk *chunk) {
+        // chunks that only hold blocks set before they were generated would lose the terrain if saved
+        if (chunk->is_void() || !chunk->m_save_queued.test() || !chunk->m_decorated.test())
+            return;
+        save_chunk(chunk);
+        num_saved++;
+    });
+    m_chunk_store.flush();
+    log(LogLevel::INFO, "World", "Saved {} remaining chunks", num_saved);
+
+    m_chunk_map.for_each([] (i32vec3, Chunk *chunk) {
+        if (!chunk->is_void())
+            delete chunk;
+    });
+    for (auto [chunk, pass] : m_retired_chunks)
         delete chunk;
 }
 
+// bumped whenever a chunk pointer in the map gets replaced, which invalidates every thread's cached chunk
+static std::atomic<u32> chunk_map_epoch = 0;
 static thread_local i32vec3 last_chunk_pos = i32vec3(INT_MAX);
 static thread_local Chunk *last_chunk = nullptr;
+static thread_local u32 last_chunk_epoch = 0;
 
 Chunk* World::get_chunk(i32vec3 chunk_pos) {
-    if (chunk_pos == last_chunk_pos) [[likely]]
+    u32 epoch = chunk_map_epoch.load(std::memory_order_acquire);
+    if (chunk_pos == last_chunk_pos && epoch == last_chunk_epoch) [[likely]]
         return last_chunk;
-    last_chunk_pos = chunk_pos;
 
-    std::shared_lock guard(m_chunk_map_mutex);
-    auto it = m_chunk_map.find(chunk_pos);
-    Chunk *chunk = nullptr;
-    if (it != m_chunk_map.end())
-        chunk = it->second;
-    last_chunk = chunk;
+    // a missing chunk isn't cached, inserting one doesn't bump the epoch
+    Chunk *chunk = m_chunk_map.find(chunk_pos);
+    if (chunk) {
+        last_chunk_pos = chunk_pos;
+        last_chunk_epoch = epoch;
+        last_chunk = chunk;
+    }
     return chunk;
 }
 
 Chunk* World::get_or_queue_chunk(i32vec3 chunk_pos) {
-    if (chunk_pos == last_chunk_pos && last_chunk) [[likely]]
+    u32 epoch = chunk_map_epoch.load(std::memory_order_acquire);
+    if (chunk_pos == last_chunk_pos && epoch == last_chunk_epoch && last_chunk) [[likely]]
         return last_chunk;
     last_chunk_pos = chunk_pos;
+    last_chunk_epoch = epoch;
 
-    std::scoped_lock guard(m_chunk_map_mutex);
-    auto it = m_chunk_map.find(chunk_pos);
-    if (it != m_chunk_map.end() && it->second) {
-        last_chunk = it->second;
-    } else {
-        auto chunk = new Chunk(chunk_pos);
-        m_chunk_map[chunk_pos] = chunk;
-        m_chunks_to_shape.enqueue(chunk_pos);
-        last_chunk = chunk;
+    auto [chunk, inserted] = m_chunk_map.find_or_insert(chunk_pos, [&] {
+        return new Chunk(chunk_pos);
+    });
+    if (inserted)
+        m_chunks_to_generate.enqueue(chunk_pos);
+    last_chunk = chunk;
+    return chunk;
+}
+
+void World::set_chunk(i32vec3 chunk_pos, Chunk *chunk) {
+    m_chunk_map.set(chunk_pos, chunk);
+    chunk_map_epoch.fetch_add(1, std::memory_order_release);
+}
+
+Chunk* World::materialize_chunk(i32vec3 chunk_pos) {
+    Chunk *chunk = new Chunk(chunk_pos);
+    chunk->m_decorated.test_and_set();
+    // the void chunk never got a mesh, this one will as soon as the write lands
+    chunk->m_will_mesh.test_and_set();
+    while (!m_chunk_map.replace(chunk_pos, Chunk::void_chunk(), chunk)) {
+        // Someone else got here first, or the chunk got unloaded in the meantime and has to be
+        // loaded or generated again. The cache may still hold the void chunk.
+        last_chunk_pos = i32vec3(INT_MAX);
+        Chunk *current = get_or_queue_chunk(chunk_pos);
+        if (!current->is_void()) {
+            delete chunk;
+            return current;
+        }
     }
-    return last_chunk;
+    chunk_map_epoch.fetch_add(1, std::memory_order_release);
+    last_chunk_pos = chunk_pos;
+    last_chunk = chunk;
+    last_chunk_epoch = chunk_map_epoch.load(std::memory_order_acquire);
+    return chunk;
+}
+
+void World::retire_chunk(Chunk *chunk) {
+    chunk_map_epoch.fetch_add(1, std::memory_order_release);
+    m_retired_chunks.emplace_back(chunk, m_generation_pass);
 }
+
+void World::free_retired_chunks() {
+    std::erase_if(m_retired_chunks, [&] (auto &retired) {
+        auto [chunk, pass] = retired;
+        if (m_generation_pass - pass < 4)
+            return false;
+        // the renderer still has a mesh builder pointing at it and will set m_mesh once it takes it
+        if (chunk->m_meshes_in_flight.load(std::memory_order_acquire) != 0)
+            return false;
+        if (chunk->m_mesh) {
+            entt::locator<renderer::ChunkRenderer>::value().m_meshes_to_free.enqueue(chunk->m_mesh);
+            chunk->m_mesh = nullptr;
+        }
+        // A late writer may still have queued changes on it. If the chunk got loaded again they
+        // go to that one, otherwise into the store on top of what was saved on unload.
+        if (chunk->m_blocks_to_change.size_approx() != 0) {
+            Chunk *current = m_chunk_map.find(chunk->m_chunk_pos);
+            BlockChange change;
+            if (current) {
+                while (chunk->m_blocks_to_change.try_dequeue(change)) {
+                    i32vec3 offset(change.index % Chunk::size, change.index / Chunk::area, (change.index / Chunk::size) % Chunk::size);
+                    set_block_at(chunk->m_chunk_pos * Chunk::size + offset, change.block_nid);
+                }
+            } else {
+                chunk->apply_changes();
+                save_chunk(chunk);
+            }
+        }
+        delete chunk;
+        return true;
+    });
+}
+
+// Runs between passes with no workers around, so nothing else is writing to these chunks
+void World::elide_void_chunks() {
+    i32vec3 chunk_pos;
+    while (m_void_chunks.try_dequeue(chunk_pos)) {
+        Chunk *chunk = m_chunk_map.find(chunk_pos);
+        if (!chunk || chunk->is_void())
+            continue;
+        bool untouched = chunk->m_storage->is_uniform() && chunk->m_storage->uniform_value() == 0
+            && chunk->m_light->is_uniform() && chunk->m_light->uniform_value() == (u16)~0
+            && chunk->m_blocks_to_change.size_approx() == 0 && !chunk->m_dirty.test();
+        if (untouched && m_chunk_map.replace(chunk_pos, chunk, Chunk::void_chunk())) {
+            retire_chunk(chunk);
+        } else {
+            // something got written in the meantime, keep it as a regular chunk
+            chunk->m_decorated.test_and_set();
+        }
+    }
+}
+
 static std::mutex print_mutex;
 
 Chunk* World::get_or_queue_chunk_with_mesh(i32vec3 chunk_pos) {
     auto chunk = get_or_queue_chunk(chunk_pos);
+    if (chunk->is_void())
+        return chunk; // nothing to mesh
     if (chunk->m_will_mesh.test_and_set() == false)
         mark_chunk_mesh_dirty(chunk_pos);
     return chunk;
@@ -156,12 +213,23 @@ BlockNID World::get_block_at(i32vec3 pos) {
     return chunk->get_block_at(chunk_offset);
 }
 
+BlockNID World::get_block_at_unlocked(i32vec3 pos) {
+    auto [chunk_pos, chunk_offset] = signed_i32vec3_divide(pos, Chunk::size);
+    return get_or_queue_chunk(chunk_pos)->get_block_at_unlocked(chunk_offset);
+}
+
 void World::set_block_at(i32vec3 pos, BlockNID block_nid) {
     auto [chunk_pos, chunk_offset] = signed_i32vec3_divide(pos, Chunk::size);
     auto chunk = get_or_queue_chunk(chunk_pos);
-    chunk->change_block_at(chunk_offset, block_nid);
+    if (chunk->is_void()) {
+        if (block_nid == 0)
+            return;
+        chunk = materialize_chunk(chunk_pos);
+    }
+    chunk->change_block_at(*this, chunk_offset, block_nid);
 
-    if (!chunk->m_will_save.test_and_set())
+    chunk->m_will_save.test_and_set();
+    if (!chunk->m_save_queued.test_and_set())
         m_chunks_to_save.enqueue(chunk_pos);
 }
 
@@ -173,6 +241,11 @@ u16 World::get_light_at(i32vec3 pos) {
 void World::set_light_at(i32vec3 pos, u16 light) {
     auto [chunk_pos, chunk_offset] = signed_i32vec3_divide(pos, Chunk::size);
     auto chunk = get_or_queue_chunk(chunk_pos);
+    if (chunk->is_void()) {
+        if (light == (u16)~0)
+            return;
+        chunk = materialize_chunk(chunk_pos);
+    }
     chunk->set_light_at(chunk_offset, light);
 
     mark_chunk_mesh_dirty(chunk_pos);
@@ -262,6 +335,24 @@ inline u16 with_intensity(u16 light, uint intensity) {
 }
 
 void World::add_light(i32vec3 pos, u16 light) {
+    m_light_changes.enqueue(LightChange(pos, light));
+}
+
+void World::remove_light(i32vec3 pos) {
+    m_light_changes.enqueue(LightChange(pos, 0));
+}
+
+void World::apply_light_changes() {
+    LightChange change;
+    while (m_light_changes.try_dequeue(change)) {
+        if (change.light == 0)
+            clear_light(change.pos);
+        else
+            place_light(change.pos, change.light);
+    }
+}
+
+void World::place_light(i32vec3 pos, u16 light) {
     set_light_at(pos, light);
     m_light_propagation_queue.emplace(pos);
     propagate_light();
@@ -273,7 +364,7 @@ constexpr std::array neighbor_offsets = std::to_array<i32vec3>({
     i32vec3( 0,  0,  1), i32vec3( 0,  0, -1)
 });
 
-void World::remove_light(i32vec3 pos) {
+void World::clear_light(i32vec3 pos) {
     m_light_removal_queue.emplace(pos, get_light_at(pos));
     set_light_at(pos, 0);
     while (!m_light_removal_queue.empty()) {
@@ -303,7 +394,7 @@ void World::propagate_light() {
         uint current_light_level = intensity(current_light);
         for (i32vec3 neighbor_offset : neighbor_offsets) {
             i32vec3 neighbor_pos = current_pos + neighbor_offset;
-            if (get_block_data(get_block_at(neighbor_pos))->m_top_transparent && intensity(get_light_at(neighbor_pos)) + 2 <= current_light_level) {
+            if (get_block_data(get_block_at_unlocked(neighbor_pos))->m_top_transparent && intensity(get_light_at(neighbor_pos)) + 2 <= current_light_level) {
                 set_light_at(neighbor_pos, with_intensity(current_light, current_light_level - 1));
                 m_light_propagation_queue.emplace(neighbor_pos);
             }
@@ -312,45 +403,35 @@ void World::propagate_light() {
 }
 
 static ParallelExecutor executor;
-static std::atomic_int num_shaped, num_decorated, num_applied, num_meshed;
+static std::atomic_int num_generated, num_applied, num_meshed;
 
-void World::shape_chunks() {
-    num_shaped = 0;
+void World::generate_chunks() {
+    num_generated = 0;
     executor.run([&] (u8) {
         i64 time_spent = 0;
         i32vec3 chunk_pos;
-        while (time_spent < 6000 && m_chunks_to_shape.try_dequeue(chunk_pos)) {
+        while (time_spent < 6000 && m_chunks_to_generate.try_dequeue(chunk_pos)) {
             auto start = std::chrono::steady_clock::now();
-            shape_chunk(chunk_pos);
-            m_chunks_to_decorate.enqueue(chunk_pos);
-
-            auto stop = std::chrono::steady_clock::now();
-            auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
-            time_spent += duration.count();
-            num_shaped++;
-        }
-    });
-}
-
-void World::decorate_chunks() {
-    num_decorated = 0;
-    executor.run([&] (u8) {
-        i64 time_spent = 0;
-        i32vec3 chunk_pos;
-        while (time_spent < 6000 && m_chunks_to_decorate.try_dequeue(chunk_pos)) {
-            auto start = std::chrono::steady_clock::now();
-            decorate_chunk(chunk_pos);
+            if (!load_chunk(chunk_pos))
+                generate_chunk(chunk_pos);
             m_loaded_chunks.enqueue(chunk_pos);
-            num_decorated++;
+            num_generated++;
 
             auto stop = std::chrono::steady_clock::now();
             auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
             time_spent += duration.count();
         }
     });
+
+    m_generation_pass++;
+    free_retired_chunks();
+    elide_void_chunks();
 }
 
 void World::apply_changes() {
+    // light goes first, the block changes queued along with it overwrite the light where they land
+    apply_light_changes();
+
     num_applied = 0;
     executor.run([&] (u8) {
         i32vec3 chunk_pos;
@@ -382,20 +463,36 @@ void World::mesh_chunks() {
                 }
                 continue;
             }
-
-            renderer::ChunkMeshBuilder *mesh_builder;
-            if (!renderer.m_available_mesh_builders.try_dequeue(mesh_builder)) {
-                m_chunks_failed_to_mesh.enqueue(chunk_pos);
-                break;
+            if (chunk->is_void())
+                continue; // got elided while queued, there is nothing to mesh
+
+            // the border needs every neighbour, retry later if one isn't there yet
+            renderer::ChunkNeighborhood neighborhood;
+            bool missing_chunk = false;
+            for (i32 y = -1; y < 2; y++) {
+                for (i32 z = -1; z < 2; z++) {
+                    for (i32 x = -1; x < 2; x++) {
+                        auto neighbor = get_or_queue_chunk(chunk_pos + i32vec3(x, y, z));
+                        if (!neighbor || !neighbor->m_decorated.test())
+                            missing_chunk = true;
+                        neighborhood.chunks[coords_to_index<3>(x + 1, y + 1, z + 1)] = neighbor;
+                    }
+                }
             }
+            if (missing_chunk) {
+                m_chunks_failed_to_mesh.enqueue(chunk_pos);
+            } else {
+                renderer::ChunkMeshBuilder *mesh_builder;
+                if (!renderer.m_available_mesh_builders.try_dequeue(mesh_builder)) {
+                    m_chunks_failed_to_mesh.enqueue(chunk_pos);
+                    break;
+                }
 
-            if (mesh_builder->build(chunk)) {
+                mesh_builder->build(neighborhood);
+                chunk->m_meshes_in_flight.fetch_add(1, std::memory_order_relaxed);
                 chunk->m_mesh_dirty.clear();
                 renderer.m_finished_mesh_builders.enqueue(mesh_builder);
                 num_meshed++;
-            } else {
-                m_chunks_failed_to_mesh.enqueue(chunk_pos);
-                renderer.m_available_mesh_builders.enqueue(mesh_builder);
             }
 
             auto stop = std::chrono::steady_clock::now();
@@ -410,12 +507,88 @@ void World::mesh_chunks() {
             m_chunks_to_mesh.enqueue_bulk(chunks, num);
     });
 
-    // log(LogLevel::INFO, "World", "Shaped {}, Decorated {}, Applied {}, Meshed {} chunks", num_shaped.load(), num_decorated.load(), num_applied.load(), num_meshed.load());
-    // log(LogLevel::INFO, "World", "{} to shape, {} to decorate, {} to apply, {} to mesh", m_chunks_to_shape.size_approx(), m_chunks_to_decorate.size_approx(), m_dirty_chunks.size_approx(), m_chunks_to_mesh.size_approx());
+    // log(LogLevel::INFO, "World", "Generated {}, Applied {}, Meshed {} chunks", num_generated.load(), num_applied.load(), num_meshed.load());
+    // log(LogLevel::INFO, "World", "{} to generate, {} to apply, {} to mesh", m_chunks_to_generate.size_approx(), m_dirty_chunks.size_approx(), m_chunks_to_mesh.size_approx());
+}
+
+bool World::load_chunk(i32vec3 chunk_pos) {
+    std::vector<u8> bytes;
+    if (!m_chunk_store.load(chunk_pos, bytes))
+        return false;
+
+    Chunk *chunk = get_chunk(chunk_pos);
+    SerialReader reader(bytes);
+    // the edits in a delta only make sense on the terrain they were made on
+    bool other_generator = false;
+    auto regenerate = [&] (u32 generator, BlockNID *blocks, u16 *light) {
+        if (generator != generator_id()) {
+            other_generator = true;
+            return false;
+        }
+        generate_baseline(chunk_pos, blocks, light);
+        return true;
+    };
+    if (!chunk->deserialize(reader, regenerate)) {
+        if (other_generator)
+            log(LogLevel::ERROR, "World", "Saved chunk at {} holds changes to another generator's terrain, generating it again without them", chunk_pos);
+        else
+            log(LogLevel::ERROR, "World", "Saved chunk at {} is corrupted, generating it again", chunk_pos);
+        static const std::array<BlockNID, Chunk::volume> empty {};
+        chunk->set_blocks(empty.data()); // don't let generation merge in half of the broken data
+        return false;
+    }
+    chunk->share_storage();
+    // pregenerated worlds save empty space too, that still becomes the void chunk
+    if (chunk->m_storage->is_uniform() && chunk->m_storage->uniform_value() == 0) {
+        m_void_chunks.enqueue(chunk_pos);
+        return true;
+    }
+    chunk->m_decorated.test_and_set();
+    return true;
+}
+
+void World::save_chunk(Chunk *chunk) {
+    // cleared first, so a change landing while this runs queues the chunk again
+    chunk->m_save_queued.clear();
+    static thread_local std::array<BlockNID, Chunk::volume> baseline_blocks;
+    static thread_local std::array<u16, Chunk::volume> baseline_light;
+    // generated chunks remember it, loaded ones only after it was generated for their first save
+    if (chunk->get_baseline(baseline_blocks.data())) {
+        Chunk::initial_light(baseline_blocks.data(), baseline_light.data());
+    } else {
+        generate_baseline(chunk->m_chunk_pos, baseline_blocks.data(), baseline_light.data());
+        chunk->set_baseline(baseline_blocks.data());
+    }
+    chunk_codec::Baseline baseline { generator_id(), baseline_blocks.data(), baseline_light.data() };
+    SerialWriter writer;
+    if (chunk->serialize(writer, &baseline))
+        m_chunk_store.save(chunk->m_chunk_pos, writer.take());
+}
+
+void World::unload_chunk(i32vec3 chunk_pos, Chunk *chunk) {
+    m_chunk_map.erase(chunk_pos);
+    if (chunk->is_void()) {
+        chunk_map_epoch.fetch_add(1, std::memory_order_release);
+        return;
+    }
+
+    if (chunk->m_save_queued.test())
+        save_chunk(chunk);
+    // the mesh goes back to the renderer once the chunk itself is freed
+    retire_chunk(chunk);
 }
 
 void World::check_chunks() {
     renderer::ChunkRenderer &renderer = entt::locator<renderer::ChunkRenderer>::value();
+    i32vec3 center = signed_i32vec3_divide(Game::get()->camera()->block_pos(), Chunk::size).first;
+    // a bit past the render sphere, the mesher still needs the neighbours of the outermost chunks
+    i32 keep_distance = renderer.m_render_distance + 2;
+    auto chunk_memory = chunk_allocator::stats();
+    usize memory_budget = m_memory_budget.load(); // the same budget for the whole pass
+    bool over_budget = chunk_memory.live_bytes > memory_budget;
+
+    std::mutex candidates_mutex;
+    std::vector<std::pair<i32, i32vec3>> unload_candidates;
     executor.run([&] (u8) {
         i32vec3 chunk_pos;
         while (m_loaded_chunks.try_dequeue(chunk_pos)) {
@@ -428,28 +601,168 @@ void World::check_chunks() {
                 continue;
             }
 
-            // if (!unload) {
+            // void chunks only cost a map entry, but those pile up too while exploring
+            i32 distance = i32vec3_distance_squared(chunk_pos, center);
+            bool busy = !chunk->m_decorated.test() || chunk->m_dirty.test() || chunk->m_mesh_dirty.test() || chunk->m_blocks_to_change.size_approx() != 0;
+            if (distance <= keep_distance * keep_distance || busy || (!over_budget && !chunk->is_void())) {
+                // edits unshare the storages, they are shared again once a whole tick went by without any
+                if (!busy && !chunk->is_void()) {
+                    if (chunk->m_settling.test())
+                        chunk->m_settling.clear();
+                    else
+                        chunk->share_storage();
+                }
                 m_checked_chunks.enqueue(chunk_pos);
-            // } else {
-            //     if (chunk->m_mesh) {
-            //         chunk->m_will_mesh.clear();
-            //         chunk->m_mesh_dirty.clear();
-            //         renderer.m_meshes_to_free.enqueue(chunk->m_mesh);
-            //         chunk->m_mesh = nullptr;
-            //     }
-            //     {
-            //         std::scoped_lock guard(m_chunk_map_mutex);
-            //         m_chunk_map[chunk->m_chunk_pos] = nullptr;
-            //     }
-            //     if (last_chunk == chunk)
-            //         last_chunk = nullptr;
-            //     delete chunk;
-            // }
+                continue;
+            }
+            std::scoped_lock guard(candidates_mutex);
+            unload_candidates.emplace_back(distance, chunk_pos);
         }
     });
+
+    // farthest first, and only about as many as it takes to get back under budget. Retired chunks
+    // are not freed yet, so count them as already gone.
+    std::sort(unload_candidates.begin(), unload_candidates.end(), [] (auto &a, auto &b) { return a.first > b.first; });
+    usize bytes_per_chunk = chunk_memory.live_bytes / std::max<usize>(m_chunk_map.size(), 1);
+    usize pending_bytes = m_retired_chunks.size() * bytes_per_chunk;
+    usize bytes_to_free = chunk_memory.live_bytes > memory_budget + pending_bytes ? chunk_memory.live_bytes - memory_budget - pending_bytes : 0;
+    usize bytes_freed = 0;
+    usize num_unloaded = 0;
+    for (auto [distance, chunk_pos] : unload_candidates) {
+        auto chunk = m_chunk_map.find(chunk_pos);
+        if (chunk->is_void()) {
+            unload_chunk(chunk_pos, chunk);
+            num_unloaded++;
+        } else if (bytes_freed < bytes_to_free) {
+            unload_chunk(chunk_pos, chunk);
+            bytes_freed += bytes_per_chunk;
+            num_unloaded++;
+        } else {
+            m_checked_chunks.enqueue(chunk_pos);
+        }
+    }
+    // chunks this far out are generated already, any that aren't just compute their heightmap again
+    if (num_unloaded != 0) {
+        m_columns.evict_if([&] (i32vec2 column_pos) {
+            i32vec2 d = column_pos - i32vec2(center.x, center.z);
+            return d.x * d.x + d.y * d.y > keep_distance * keep_distance;
+        });
+    }
+
     executor.run([&] (u8) {
         i32vec3 chunks[8];
         while (usize num = m_checked_chunks.try_dequeue_bulk(chunks, 8))
             m_loaded_chunks.enqueue_bulk(chunks, num);
     });
 }
+
+void World::save_chunks() {
+    // only serializes, the chunk store writes on its own thread
+    executor.run([&] (u8) {
+        i64 time_spent = 0;
+        i32vec3 chunk_pos;
+        std::vector<i32vec3> not_ready;
+        while (time_spent < 2000 && m_chunks_to_save.try_dequeue(chunk_pos)) {
+            auto start = std::chrono::steady_clock::now();
+            auto chunk = get_chunk(chunk_pos);
+            if (chunk && (chunk->m_dirty.test() || !chunk->m_decorated.test())) {
+                // changes still waiting to be applied, or terrain not generated yet, would be missing from the save
+                not_ready.push_back(chunk_pos);
+                continue;
+            }
+            if (chunk && !chunk->is_void() && chunk->m_save_queued.test()) // may have been unloaded and saved already
+                save_chunk(chunk);
+
+            auto stop = std::chrono::steady_clock::now();
+            auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - start);
+            time_spent += duration.count();
+        }
+        m_chunks_to_save.enqueue_bulk(not_ready.begin(), not_ready.size());
+    });
+}
+
+void World::pregenerate(i32 radius) {
+    // Goes through the sphere one x slice at a time. Generating a chunk doesn't touch any other
+    // chunk, so each slice is saved and dropped as soon as it is generated.
+    auto in_sphere = [] (i32vec3 chunk_pos, i32 sphere_radius) {
+        return i32vec3_distance_squared(chunk_pos, i32vec3(0)) <= sphere_radius * sphere_radius;
+    };
+    usize num_total = 0;
+    for (i32 x = -radius; x <= radius; x++)
+        for (i32 y = -radius; y <= radius; y++)
+            for (i32 z = -radius; z <= radius; z++)
+                num_total += in_sphere(i32vec3(x, y, z), radius);
+    log(LogLevel::INFO, "World", "Pregenerating {} chunks on {} threads", num_total, executor.num_workers + 1);
+
+    auto start = std::chrono::steady_clock::now();
+    auto last_report = start;
+    usize num_done = 0, num_bytes = 0;
+    for (i32 slice_x = -radius; slice_x <= radius; slice_x++) {
+        for (i32 y = -radius; y <= radius; y++)
+            for (i32 z = -radius; z <= radius; z++)
+                if (in_sphere(i32vec3(slice_x, y, z), radius))
+                    get_or_queue_chunk(i32vec3(slice_x, y, z));
+
+        // like generate_chunks, minus the time budget
+        while (m_chunks_to_generate.size_approx() != 0 || m_dirty_chunks.size_approx() != 0) {
+            executor.run([&] (u8) {
+                i32vec3 chunk_pos;
+                while (m_chunks_to_generate.try_dequeue(chunk_pos)) {
+                    if (!load_chunk(chunk_pos))
+                        generate_chunk(chunk_pos);
+                }
+            });
+            apply_changes();
+            m_generation_pass++;
+            free_retired_chunks();
+            elide_void_chunks();
+        }
+
+        ConcurrentQueue<i32vec3> chunks_to_save;
+        for (i32 y = -radius; y <= radius; y++)
+            for (i32 z = -radius; z <= radius; z++)
+                if (in_sphere(i32vec3(slice_x, y, z), radius))
+                    chunks_to_save.enqueue(i32vec3(slice_x, y, z));
+        std::atomic<usize> slice_chunks = 0, slice_bytes = 0;
+        executor.run([&] (u8) {
+            i32vec3 chunk_pos;
+            while (chunks_to_save.try_dequeue(chunk_pos)) {
+                // a full snapshot even where it matches generation, loading it is what saves the time.
+                // Empty space became the void chunk, which is quicker to generate than to load.
+                Chunk *chunk = get_chunk(chunk_pos);
+                slice_chunks++;
+                if (!chunk || chunk->is_void())
+                    continue;
+                chunk->m_save_queued.clear();
+                SerialWriter writer;
+                if (!chunk->serialize(writer))
+                    continue;
+                slice_bytes += writer.size();
+                m_chunk_store.save(chunk_pos, writer.take());
+            }
+        });
+        num_done += slice_chunks;
+        num_bytes += slice_bytes;
+
+        std::vector<std::pair<i32vec3, Chunk*>> chunks_to_drop;
+        m_chunk_map.for_each([&] (i32vec3 chunk_pos, Chunk *chunk) {
+            chunks_to_drop.emplace_back(chunk_pos, chunk);
+        });
+        for (auto [chunk_pos, chunk] : chunks_to_drop) {
+            chunk->m_save_queued.clear();
+            unload_chunk(chunk_pos, chunk);
+        }
+        // the next slice still reads the structures of this one's columns
+        m_columns.evict_if([&] (i32vec2 column_pos) { return column_pos.x < slice_x; });
+        i32vec3 chunk_pos;
+        while (m_loaded_chunks.try_dequeue(chunk_pos) || m_chunks_to_save.try_dequeue(chunk_pos)) {}
+
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_report >= std::chrono::seconds(1) || slice_x == radius) {
+            f64 seconds = std::chrono::duration<f64>(now - start).count();
+            log(LogLevel::INFO, "World", "{}/{} chunks ({}%), {} chunks/s, {} MiB saved, {} waiting to be written",
+                num_done, num_total, num_done * 100 / std::max<usize>(num_total, 1), (f64)num_done / seconds, num_bytes / 1024.0 / 1024.0, m_chunk_store.num_pending());
+            last_report = now;
+        }
+    }
+}
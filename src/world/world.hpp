@@ -1,18 +1,22 @@
 #pragma once
 
-#include <unordered_map>
 #include <queue>
-#include <shared_mutex>
-#define GLM_ENABLE_EXPERIMENTAL
-#include <glm/gtx/hash.hpp>
+#include <atomic>
+#include <mutex>
 #include <FastNoise/FastNoise.h>
 #include <moodycamel/concurrentqueue.h>
 
 #include "chunk.hpp"
+#include "chunk_map.hpp"
+#include "chunk_store.hpp"
+#include "column_cache.hpp"
+#include "world_rng.hpp"
 
 class World {
 public:
     World();
+    // saves and dictionaries live in directory instead of the default world's
+    World(const std::filesystem::path &directory);
     ~World();
 
     Chunk* get_chunk(i32vec3 chunk_pos);
@@ -20,23 +24,32 @@ public:
     Chunk* get_or_queue_chunk_with_mesh(i32vec3 chunk_pos);
     void set_chunk(i32vec3 chunk_pos, Chunk *chunk);
 
+    // chunks outside the render sphere get unloaded while chunk memory is above the budget
+    inline usize memory_budget() const { return m_memory_budget.load(); }
+    inline void set_memory_budget(usize bytes) { m_memory_budget.store(bytes); }
+
     BlockNID get_block_at(i32vec3 pos);
     void set_block_at(i32vec3 pos, BlockNID block_nid);
+    // for the tick thread only, nothing else ever touches light (see Chunk::m_storage_mutex)
     u16 get_light_at(i32vec3 pos);
-    void set_light_at(i32vec3 pos, u16 light);
 
+    // queued like block changes and spread through the world by the next apply_changes, so any
+    // thread may call them
     void add_light(i32vec3 pos, u16 light);
     void remove_light(i32vec3 pos);
     
     void mark_chunk_dirty(Chunk *chunk);
     void mark_chunk_mesh_dirty(i32vec3 chunk_pos);
 
-    void shape_chunks();
-    void decorate_chunks();
+    void generate_chunks();
     void apply_changes();
     void mesh_chunks();
     void check_chunks();
-    void propagate_light();
+    void save_chunks();
+
+    // Generates every chunk within radius chunks of the origin and saves it, so it only has to be
+    // loaded later. Runs without a renderer, nothing may be driving the world at the same time.
+    void pregenerate(i32 radius);
 
     struct RayCastResult {
         bool hit;
@@ -48,20 +61,38 @@ public:
     RayCastResult cast_ray(vec3 start_pos, vec3 end_pos);
     bool is_position_valid(vec3 pos, vec3 min_bounds, vec3 max_bounds);
 
+    // The generation stages, writing into a zeroed buffer without touching any chunk. Public so
+    // they can be benchmarked on their own, any number of threads may call them.
+    // shape_chunk returns true without touching blocks if the whole chunk is uniform_block, which
+    // also means there is nothing to decorate.
+    bool shape_chunk(i32vec3 chunk_pos, BlockNID *blocks, BlockNID &uniform_block);
+    void decorate_chunk(i32vec3 chunk_pos, BlockNID *blocks);
+    // rolls the decoration and structures of a column whose heights are already filled in
+    void decorate_column(i32vec2 column_pos, ColumnCache::Column &column);
+
 private:
     i32 m_seed;
 
-    std::unordered_map<i32vec3, Chunk*> m_chunk_map;
-    std::shared_mutex m_chunk_map_mutex;
+    ChunkMap m_chunk_map;
+    std::atomic<usize> m_memory_budget = 1024ull * 1024 * 1024; // set from the render thread
+
+    // modified chunks, everything else is simply generated again
+    ChunkStore m_chunk_store;
+    // heightmaps shared by every chunk in a column, dropped along with the chunks far away
+    ColumnCache m_columns;
 
     ConcurrentQueue<i32vec3> m_dirty_chunks;
-    ConcurrentQueue<i32vec3> m_chunks_to_shape;
-    ConcurrentQueue<i32vec3> m_chunks_to_decorate;
+    ConcurrentQueue<i32vec3> m_chunks_to_generate;
     ConcurrentQueue<i32vec3> m_chunks_to_mesh;
     ConcurrentQueue<i32vec3> m_chunks_failed_to_mesh;
     ConcurrentQueue<i32vec3> m_loaded_chunks;
     ConcurrentQueue<i32vec3> m_checked_chunks;
     ConcurrentQueue<i32vec3> m_chunks_to_save;
+    ConcurrentQueue<i32vec3> m_void_chunks; // generated all void, waiting to be swapped for the void chunk
+
+    // chunks taken out of the map, only freed a few generation passes later when nobody can still hold them
+    std::vector<std::pair<Chunk*, u64>> m_retired_chunks;
+    u64 m_generation_pass = 0;
 
     FastNoise::SmartNode<FastNoise::Simplex> m_ridged_simplex_noise;
     FastNoise::SmartNode<FastNoise::FractalRidged> m_ridged_noise;
@@ -70,12 +101,41 @@ private:
     FastNoise::SmartNode<FastNoise::MaxSmooth> m_max_smooth;
     FastNoise::SmartNode<FastNoise::Simplex> m_cave_noise;
 
+    struct LightChange {
+        i32vec3 pos;
+        u16 light; // 0 removes the light at pos
+    };
+    ConcurrentQueue<LightChange> m_light_changes;
     std::queue<i32vec3> m_light_propagation_queue;
     std::queue<std::pair<i32vec3, u16>> m_light_removal_queue;
 
-    void generate_noise(std::array<f32, Chunk::area> &out, i32 x_start, i32 z_start);
-    void shape_chunk(i32vec3 chunk_pos);
-    usize pos_hash(i32vec3 world_pos);
-    void generate_tree(i32vec3 world_pos);
-    void decorate_chunk(i32vec3 chunk_pos);
+    // only ever run on the tick thread with no workers around
+    BlockNID get_block_at_unlocked(i32vec3 pos);
+    void apply_light_changes();
+    void set_light_at(i32vec3 pos, u16 light);
+    void place_light(i32vec3 pos, u16 light);
+    void clear_light(i32vec3 pos);
+    void propagate_light();
+
+    std::shared_ptr<const ColumnCache::Column> get_column(i32vec2 column_pos);
+    // the structures of the surrounding columns that reach into the chunk, valid until the next call on this thread
+    const std::vector<ColumnCache::Structure>& structures_in(i32vec3 chunk_pos);
+    u32 roll(i32vec3 world_pos, world_rng::Feature feature, u32 n);
+    // blocks outside the chunk are dropped, the chunks they fall in place them themselves
+    void place_generated_block(i32vec3 chunk_pos, BlockNID *blocks, i32vec3 world_pos, BlockNID block_nid);
+    i32 tree_length(i32vec3 world_pos);
+    void generate_tree(i32vec3 chunk_pos, BlockNID *blocks, i32vec3 world_pos);
+    void generate_chunk(i32vec3 chunk_pos);
+    // What generation gives for the chunk, without any changes made to it afterwards.
+    // Saved chunks are stored as the difference to this.
+    void generate_baseline(i32vec3 chunk_pos, BlockNID *blocks, u16 *light);
+    u32 generator_id() const;
+
+    Chunk* materialize_chunk(i32vec3 chunk_pos);
+    void retire_chunk(Chunk *chunk);
+    void free_retired_chunks();
+    void elide_void_chunks();
+    bool load_chunk(i32vec3 chunk_pos);
+    void save_chunk(Chunk *chunk);
+    void unload_chunk(i32vec3 chunk_pos, Chunk *chunk);
 };
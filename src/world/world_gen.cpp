@@ -1,48 +1,137 @@
 #include "world.hpp"
+#include "caves.hpp"
+#include "noise_upsample.hpp"
+
+#include <algorithm>
+
+// bump whenever generation changes, so chunks saved against the old terrain get their deltas
+// replayed onto the new one with a warning
+constexpr u32 generator_version = 4;
 
 constexpr i32 noise_factor = 2;
-constexpr i32 noise_size = Chunk::size / noise_factor + 1;
-constexpr i32 noise_area = noise_size * noise_size;
+constexpr i32 noise_size = noise_upsample::coarse_size<Chunk::size, noise_factor>;
+constexpr i32 column_tile_size = 4; // columns per side of a tile generated together
+constexpr i32 cave_noise_size = noise_upsample::coarse_size<Chunk::size, caves::noise_factor>;
 
-void World::generate_noise(std::array<f32, Chunk::area> &out, i32 x_start, i32 z_start) {
+std::shared_ptr<const ColumnCache::Column> World::get_column(i32vec2 column_pos) {
+    if (auto column = m_columns.find(column_pos))
+        return column;
+
+    // FastNoise pays its setup for every call, and a single column is only noise_size^2 values.
+    // So a miss generates the noise for the whole tile of columns around it in one call.
     constexpr f32 frequency = 0.005f;
-    std::array<f32, noise_area> noise_output;
-    m_max_smooth->GenUniformGrid2D(noise_output.data(), x_start / 2, z_start / 2, noise_size, noise_size, frequency * 2.0f, m_seed);
-    for (i32 z = 0; z < Chunk::size; z++) {
-        for (i32 x = 0; x < Chunk::size; x++) {
-            f32 value = 0;
-            if (x % 2 == 0 && z % 2 == 0) {
-                value = noise_output[(z / 2) * noise_size + x / 2];
-            } else if (x % 2 == 0 && z % 2 != 0) {
-                value = (noise_output[(z / 2) * noise_size + x / 2] + noise_output[(z / 2 + 1) * noise_size + x / 2]) / 2.0f;
-            } else if (x % 2 != 0 && z % 2 == 0) {
-                value = (noise_output[(z / 2) * noise_size + x / 2] + noise_output[(z / 2) * noise_size + x / 2 + 1]) / 2.0f;
-            } else {
-                f32 value1 = (noise_output[(z / 2) * noise_size + x / 2] + noise_output[(z / 2) * noise_size + x / 2 + 1]) / 2.0f;
-                f32 value2 = (noise_output[(z / 2 + 1) * noise_size + x / 2] + noise_output[(z / 2 + 1) * noise_size + x / 2 + 1]) / 2.0f;
-                value = (value1 + value2) / 2.0f;
+    constexpr i32 tile_noise_size = column_tile_size * (noise_size - 1) + 1;
+    auto [tile_pos, tile_offset] = signed_i32vec3_divide(i32vec3(column_pos.x, 0, column_pos.y), column_tile_size);
+    i32vec2 first_column(tile_pos.x * column_tile_size, tile_pos.z * column_tile_size);
+    std::array<f32, tile_noise_size * tile_noise_size> noise_output;
+    m_max_smooth->GenUniformGrid2D(noise_output.data(), first_column.x * Chunk::size / noise_factor, first_column.y * Chunk::size / noise_factor,
+        tile_noise_size, tile_noise_size, frequency * 2.0f, m_seed);
+
+    std::shared_ptr<const ColumnCache::Column> result;
+    for (i32 z = 0; z < column_tile_size; z++) {
+        for (i32 x = 0; x < column_tile_size; x++) {
+            // neighbouring columns share their edge of the noise grid
+            auto column = std::make_shared<ColumnCache::Column>();
+            std::array<f32, Chunk::area> noise;
+            noise_upsample::bilinear<Chunk::size, noise_factor>(&noise_output[z * (noise_size - 1) * tile_noise_size + x * (noise_size - 1)], tile_noise_size, noise.data());
+            for (i32 i = 0; i < Chunk::area; i++)
+                column->heights[i] = std::floor(noise[i] * 32.0f);
+            auto [min_height, max_height] = std::minmax_element(column->heights.begin(), column->heights.end());
+            column->min_height = *min_height;
+            column->max_height = *max_height;
+            decorate_column(first_column + i32vec2(x, z), *column);
+
+            auto cached = m_columns.insert(first_column + i32vec2(x, z), std::move(column));
+            if (first_column + i32vec2(x, z) == column_pos)
+                result = std::move(cached);
+        }
+    }
+    return result;
+}
+
+void World::decorate_column(i32vec2 column_pos, ColumnCache::Column &column) {
+    // decoration sits right on top of the terrain, so it is rolled once per column position
+    // instead of for every block of every chunk
+    i32vec2 world_column = column_pos * Chunk::size;
+    std::array<i32vec3, Chunk::area> roots;
+    std::array<u32, Chunk::area> rolls;
+    for (i32 i = 0; i < Chunk::area; i++)
+        roots[i] = i32vec3(world_column.x + i % Chunk::size, column.heights[i] + 1, world_column.y + i / Chunk::size);
+    world_rng::roll_batch(m_seed, roots.data(), world_rng::Feature::DECORATION, 100, rolls.data(), Chunk::area);
+
+    for (i32 i = 0; i < Chunk::area; i++) {
+        i32vec3 root = roots[i];
+        column.decoration[i] = rolls[i];
+        if (root.y <= 2 || column.decoration[i] != 73)
+            continue;
+        i32 length = tree_length(root);
+        column.structures.push_back({ ColumnCache::Structure::Type::TREE, root, root + i32vec3(-2, 0, -2), root + i32vec3(2, length + 1, 2) });
+    }
+}
+
+const std::vector<ColumnCache::Structure>& World::structures_in(i32vec3 chunk_pos) {
+    static thread_local std::vector<ColumnCache::Structure> structures;
+    structures.clear();
+    i32vec3 chunk_min = chunk_pos * Chunk::size, chunk_max = chunk_min + Chunk::size - 1;
+    // nothing reaches further than a column sideways
+    for (i32 z = -1; z <= 1; z++) {
+        for (i32 x = -1; x <= 1; x++) {
+            auto column = get_column(i32vec2(chunk_pos.x + x, chunk_pos.z + z));
+            for (auto &structure : column->structures) {
+                bool overlaps = structure.min.x <= chunk_max.x && structure.min.y <= chunk_max.y && structure.min.z <= chunk_max.z
+                    && structure.max.x >= chunk_min.x && structure.max.y >= chunk_min.y && structure.max.z >= chunk_min.z;
+                if (overlaps)
+                    structures.push_back(structure);
             }
-            out[z * Chunk::size + x] = value;
         }
     }
+    return structures;
 }
 
-void World::shape_chunk(i32vec3 chunk_pos) {
-    Chunk *chunk = get_chunk(chunk_pos);
+bool World::shape_chunk(i32vec3 chunk_pos, BlockNID *blocks, BlockNID &uniform_block) {
     auto world_x = chunk_pos.x * Chunk::size;
     auto world_y = chunk_pos.y * Chunk::size;
     auto world_z = chunk_pos.z * Chunk::size;
 
-    std::array<f32, Chunk::area> noise_output;
-    generate_noise(noise_output, world_x, world_z);
+    auto column = get_column(i32vec2(chunk_pos.x, chunk_pos.z));
+
+    // Most chunks are sky, open water or solid rock. The column's height range tells those apart
+    // without looking at a single block. Sky and water are only ever placed above the terrain,
+    // nothing decorates more than a block above it either, apart from structures.
+    auto uniform = [&] (BlockNID block) {
+        if (!structures_in(chunk_pos).empty()) {
+            std::fill_n(blocks, Chunk::volume, block);
+            return false;
+        }
+        uniform_block = block;
+        return true;
+    };
+    i32 bottom = world_y, top = world_y + Chunk::size - 1;
+    if (bottom > std::max(column->max_height + 1, 0))
+        return uniform(0);
+    if (top <= 0 && bottom > column->max_height + 1)
+        return uniform(10);
+    bool below_surface = top < column->min_height - 1;
+    if (below_surface && bottom > 32)
+        return uniform(1);
 
     std::array<f32, Chunk::volume> cave_noise_output = {};
-    if (world_y <= 32)
-        m_cave_noise->GenUniformGrid3D(cave_noise_output.data(), world_x, world_y, world_z, Chunk::size, Chunk::size, Chunk::size, 0.019f, m_seed);
+    if (world_y <= 32) {
+        std::array<f32, cave_noise_size * cave_noise_size * cave_noise_size> coarse_cave_noise;
+        m_cave_noise->GenUniformGrid3D(coarse_cave_noise.data(), world_x / caves::noise_factor, world_y / caves::noise_factor, world_z / caves::noise_factor,
+            cave_noise_size, cave_noise_size, cave_noise_size, caves::frequency * caves::noise_factor, m_seed);
+        // Interpolated values never exceed the samples around them, and the multiplier is largest
+        // at the bottom. If even that can't open a cave, the chunk is solid rock. The margin covers
+        // interpolation rounding past the samples.
+        f32 max_noise = *std::max_element(coarse_cave_noise.begin(), coarse_cave_noise.end());
+        if (below_surface && caves::density(max_noise, bottom) < caves::threshold - 0.01f)
+            return uniform(1);
+        noise_upsample::trilinear<Chunk::size, caves::noise_factor>(coarse_cave_noise.data(), cave_noise_output.data());
+    }
 
     for (i32 x = 0; x < Chunk::size; x++) {
         for (i32 z = 0; z < Chunk::size; z++) {
-            i32 height = std::floor(noise_output[z * Chunk::size + x] * 32.0f);
+            i32 height = column->heights[z * Chunk::size + x];
             for (i32 y = 0; y < Chunk::size; y++) {
                 BlockNID block = 0;
                 if (world_y > 1 && world_y == height) {
@@ -59,17 +148,15 @@ void World::shape_chunk(i32vec3 chunk_pos) {
                     if (world_y > 32 && world_y < height - 1) {
                         block = 1;
                     } else {
-                        f32 cave_multiplier = 50.0f - 25.0f * std::clamp((world_y + 32.0f) / 64.0f, 0.0f, 1.0f);
-                        f32 cave_density = (cave_noise_output[z * Chunk::size * Chunk::size + y * Chunk::size + x] + 1.0f) * cave_multiplier;
-                        if (world_y < height - 1 && cave_density < 75.0f)
+                        bool cave = caves::is_cave(cave_noise_output[z * Chunk::size * Chunk::size + y * Chunk::size + x], world_y);
+                        if (world_y < height - 1 && !cave)
                             block = 1;
-                        else if (cave_density >= 75.0f)
+                        else if (cave)
                             block = 0;
                     }
                 }
 
-                if (block != 0)
-                    chunk->set_block_at(i32vec3(x, y, z), block);
+                blocks[coords_to_index<Chunk::size>(x, y, z)] = block;
 
                 world_y++;
             }
@@ -79,30 +166,42 @@ void World::shape_chunk(i32vec3 chunk_pos) {
         world_z -= Chunk::size;
         world_x++;
     }
+    return false;
+}
+
+u32 World::roll(i32vec3 world_pos, world_rng::Feature feature, u32 n) {
+    return world_rng::roll(m_seed, world_pos, feature, n);
 }
 
-usize World::pos_hash(i32vec3 world_pos) {
-    return std::hash<i32vec4>()(i32vec4(world_pos, m_seed));
+void World::place_generated_block(i32vec3 chunk_pos, BlockNID *blocks, i32vec3 world_pos, BlockNID block_nid) {
+    auto [block_chunk_pos, chunk_offset] = signed_i32vec3_divide(world_pos, Chunk::size);
+    if (block_chunk_pos == chunk_pos)
+        blocks[coords_to_index<Chunk::size>(chunk_offset.x, chunk_offset.y, chunk_offset.z)] = block_nid;
 }
 
-void World::generate_tree(i32vec3 world_pos) {
-    int length_roll = pos_hash(world_pos + i32vec3(0, 1, 0)) % 100;
+i32 World::tree_length(i32vec3 world_pos) {
+    int length_roll = roll(world_pos, world_rng::Feature::TREE_LENGTH, 100);
     int length = 5;
     if (length_roll > 50)
         length = 6;
     if (length_roll > 80)
         length = 7;
+    return length;
+}
+
+void World::generate_tree(i32vec3 chunk_pos, BlockNID *blocks, i32vec3 world_pos) {
+    i32 length = tree_length(world_pos);
 
     // generate trunk
     for (int y = 0; y < length; y++)
-        set_block_at(world_pos + i32vec3(0, y, 0), 6);
+        place_generated_block(chunk_pos, blocks, world_pos + i32vec3(0, y, 0), 6);
 
     // generate leaves
     for (int x = -2; x < 3; x++) {
         for (int z = -2; z < 3; z++) {
             if (x == 0 && z == 0)
                 continue;
-            set_block_at(world_pos + i32vec3(x, length - 2, z), 12);
+            place_generated_block(chunk_pos, blocks, world_pos + i32vec3(x, length - 2, z), 12);
         }
     }
     for (int x = -2; x < 3; x++) {
@@ -110,56 +209,111 @@ void World::generate_tree(i32vec3 world_pos) {
             if (x == 0 && z == 0)
                 continue;
             if ((x == -2 && z == -2) || (x == 2 && z == -2) || (x == -2 && z == 2) || (x == 2 && z == 2))
-                if (pos_hash(world_pos + i32vec3(x, length - 1, z)) % 100 > 25)
+                if (roll(world_pos + i32vec3(x, length - 1, z), world_rng::Feature::TREE_LEAF, 100) > 25)
                     continue;
-            set_block_at(world_pos + i32vec3(x, length - 1, z), 12);
+            place_generated_block(chunk_pos, blocks, world_pos + i32vec3(x, length - 1, z), 12);
         }
     }
     for (int x = -1; x < 2; x++)
         for (int z = -1; z < 2; z++)
-            set_block_at(world_pos + i32vec3(x, length, z), 12);
+            place_generated_block(chunk_pos, blocks, world_pos + i32vec3(x, length, z), 12);
     for (int x = -1; x < 2; x++) {
         for (int z = -1; z < 2; z++) {
             if ((x == -1 && z == -1) || (x == 1 && z == -1) || (x == -1 && z == 1) || (x == 1 && z == 1))
-                if (pos_hash(world_pos + i32vec3(x, length + 1, z)) % 100 > 25)
+                if (roll(world_pos + i32vec3(x, length + 1, z), world_rng::Feature::TREE_LEAF, 100) > 25)
                     continue;
-            set_block_at(world_pos + i32vec3(x, length + 1, z), 12);
+            place_generated_block(chunk_pos, blocks, world_pos + i32vec3(x, length + 1, z), 12);
         }
     }
 }
 
-void World::decorate_chunk(i32vec3 chunk_pos) {
-    auto world_x = chunk_pos.x * Chunk::size;
+void World::decorate_chunk(i32vec3 chunk_pos, BlockNID *blocks) {
     auto world_y = chunk_pos.y * Chunk::size;
-    auto world_z = chunk_pos.z * Chunk::size;
 
-    std::array<f32, Chunk::area> noise_output;
-    generate_noise(noise_output, world_x, world_z);
+    auto column = get_column(i32vec2(chunk_pos.x, chunk_pos.z));
 
-    for (i32 x = 0; x < Chunk::size; x++) {
-        for (i32 z = 0; z < Chunk::size; z++) {
-            i32 height = std::floor(noise_output[z * Chunk::size + x] * 32.0f);
-            for (i32 y = 0; y < Chunk::size; y++) {
-                if (world_y > 2 && world_y == height + 1) {
-                    i32vec3 world_pos(world_x, world_y, world_z);
-                    int decoration_roll = pos_hash(world_pos) % 100;
-                    if (decoration_roll > 75) // generate grass
-                        set_block_at(world_pos, 11);
-                    if (decoration_roll == 75) // generate dandelions
-                        set_block_at(world_pos, 13);
-                    if (decoration_roll == 74) // generate roses
-                        set_block_at(world_pos, 14);
-                    if (decoration_roll == 73) // generate trees
-                        generate_tree(world_pos);
-                }
-                world_y++;
-            }
-            world_y -= Chunk::size;
-            world_z++;
+    for (i32 z = 0; z < Chunk::size; z++) {
+        for (i32 x = 0; x < Chunk::size; x++) {
+            i32 surface_y = column->heights[z * Chunk::size + x] + 1;
+            i32 y = surface_y - world_y;
+            if (surface_y <= 2 || y < 0 || y >= Chunk::size)
+                continue;
+            int decoration_roll = column->decoration[z * Chunk::size + x];
+            if (decoration_roll > 75) // generate grass
+                blocks[coords_to_index<Chunk::size>(x, y, z)] = 11;
+            if (decoration_roll == 75) // generate dandelions
+                blocks[coords_to_index<Chunk::size>(x, y, z)] = 13;
+            if (decoration_roll == 74) // generate roses
+                blocks[coords_to_index<Chunk::size>(x, y, z)] = 14;
+            // a roll of 73 is a tree, those are structures of the column
         }
-        world_z -= Chunk::size;
-        world_x++;
     }
 
-    get_chunk(chunk_pos)->m_decorated.test_and_set();
+    for (auto &structure : structures_in(chunk_pos)) {
+        switch (structure.type) {
+            case ColumnCache::Structure::Type::TREE:
+                generate_tree(chunk_pos, blocks, structure.origin);
+                break;
+        }
+    }
+}
+
+u32 World::generator_id() const {
+    return (u32)m_seed * 0x9E3779B1u ^ generator_version;
+}
+
+void World::generate_baseline(i32vec3 chunk_pos, BlockNID *blocks, u16 *light) {
+    std::fill_n(blocks, Chunk::volume, 0);
+    BlockNID uniform_block;
+    if (shape_chunk(chunk_pos, blocks, uniform_block))
+        std::fill_n(blocks, Chunk::volume, uniform_block);
+    else
+        decorate_chunk(chunk_pos, blocks);
+    Chunk::initial_light(blocks, light);
+}
+
+void World::generate_chunk(i32vec3 chunk_pos) {
+    // both stages write into this buffer, so the chunk only gets packed once at the end
+    static thread_local std::array<BlockNID, Chunk::volume> blocks;
+    Chunk *chunk = get_chunk(chunk_pos);
+    bool untouched = chunk->m_storage->is_uniform() && chunk->m_storage->uniform_value() == 0;
+
+    BlockNID uniform_block;
+    blocks.fill(0);
+    if (shape_chunk(chunk_pos, blocks.data(), uniform_block)) {
+        // straight to single-palette storages, unless blocks were set in it that need merging
+        if (untouched && uniform_block != 0) {
+            chunk->fill_blocks(uniform_block);
+            chunk->keep_baseline();
+            chunk->m_decorated.test_and_set();
+            return;
+        }
+        blocks.fill(uniform_block);
+    } else {
+        decorate_chunk(chunk_pos, blocks.data());
+    }
+
+    // Nothing generated and nothing set in it, it can become the shared void chunk.
+    // It stays undecorated until then so no mesh gets built for it in the meantime.
+    bool generated_void = std::all_of(blocks.begin(), blocks.end(), [] (BlockNID nid) { return nid == 0; });
+    if (generated_void && untouched) {
+        m_void_chunks.enqueue(chunk_pos);
+        return;
+    }
+
+    // blocks may have been set in here before it was generated, keep those wherever the generated chunk is void
+    if (!untouched) {
+        std::array<BlockNID, Chunk::volume> existing;
+        chunk->get_blocks(existing.data());
+        for (uint i = 0; i < Chunk::volume; i++)
+            if (blocks[i] == 0)
+                blocks[i] = existing[i];
+    }
+
+    chunk->set_blocks(blocks.data());
+    if (untouched)
+        chunk->keep_baseline();
+    else
+        chunk->share_storage(); // not what generation gave, save_chunk generates that again
+    chunk->m_decorated.test_and_set();
 }
@@ -0,0 +1,112 @@
+#pragma once
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define WORLD_RNG_AVX2
+#endif
+
+#include "../util.hpp"
+
+// Stateless random numbers for generation: Philox4x32-10 with the position and feature as the
+// counter and the seed as the key. The same inputs give the same bits on every compiler and
+// standard library, and the order things are generated in doesn't matter. roll_batch rolls eight
+// positions at once on CPUs with AVX2, with exactly the bits roll gives.
+namespace world_rng {
+    // keeps the rolls of different features at the same position independent
+    enum class Feature : u32 {
+        DECORATION,
+        TREE_LENGTH,
+        TREE_LEAF,
+    };
+
+    struct Block {
+        u32 v[4];
+    };
+
+    // one of Philox's ten rounds, the key gets bumped by the Weyl constants in between
+    inline void philox_round(Block &c, u32 key0, u32 key1) {
+        u64 product0 = (u64)0xD2511F53u * c.v[0];
+        u64 product1 = (u64)0xCD9E8D57u * c.v[2];
+        u32 next0 = (u32)(product1 >> 32) ^ c.v[1] ^ key0;
+        u32 next2 = (u32)(product0 >> 32) ^ c.v[3] ^ key1;
+        c = { { next0, (u32)product1, next2, (u32)product0 } };
+    }
+
+    // the raw generator, exposed for checking against the reference vectors
+    inline Block philox(Block counter, u32 key0, u32 key1) {
+        for (i32 i = 0; i < 10; i++) {
+            philox_round(counter, key0, key1);
+            key0 += 0x9E3779B9u;
+            key1 += 0xBB67AE85u;
+        }
+        return counter;
+    }
+
+    // 32 random bits for a feature at a position
+    inline u32 random(u32 seed, i32vec3 pos, Feature feature) {
+        return philox({ { (u32)pos.x, (u32)pos.y, (u32)pos.z, (u32)feature } }, seed, 0).v[0];
+    }
+
+    // maps random bits to [0, n) without the bias a modulo has
+    inline u32 below(u32 bits, u32 n) {
+        return (u32)(((u64)bits * n) >> 32);
+    }
+
+    inline u32 roll(u32 seed, i32vec3 pos, Feature feature, u32 n) {
+        return below(random(seed, pos, feature), n);
+    }
+
+#ifdef WORLD_RNG_AVX2
+    // the high and low halves of a * b in every lane, the multiply only covers the even ones
+    [[gnu::target("avx2")]] inline void multiply_wide(__m256i a, __m256i b, __m256i &high, __m256i &low) {
+        __m256i even = _mm256_mul_epu32(a, b);
+        __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(a, 32), _mm256_srli_epi64(b, 32));
+        __m256i low_mask = _mm256_set1_epi64x(0xFFFFFFFFll);
+        high = _mm256_or_si256(_mm256_srli_epi64(even, 32), _mm256_andnot_si256(low_mask, odd));
+        low = _mm256_or_si256(_mm256_and_si256(even, low_mask), _mm256_slli_epi64(odd, 32));
+    }
+
+    // philox with eight counters side by side, returns how many positions it rolled
+    [[gnu::target("avx2")]] inline usize roll_batch_avx2(u32 seed, const i32vec3 *positions, Feature feature, u32 n, u32 *rolls, usize count) {
+        static_assert(sizeof(i32vec3) == 3 * sizeof(i32));
+        const __m256i multiplier0 = _mm256_set1_epi32((i32)0xD2511F53u), multiplier1 = _mm256_set1_epi32((i32)0xCD9E8D57u);
+        const __m256i stride = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+        usize i = 0;
+        for (; i + 8 <= count; i += 8) {
+            const i32 *components = &positions[i].x;
+            __m256i c0 = _mm256_i32gather_epi32(components, stride, 4);
+            __m256i c1 = _mm256_i32gather_epi32(components + 1, stride, 4);
+            __m256i c2 = _mm256_i32gather_epi32(components + 2, stride, 4);
+            __m256i c3 = _mm256_set1_epi32((i32)feature);
+            u32 key0 = seed, key1 = 0;
+            for (i32 round = 0; round < 10; round++) {
+                __m256i high0, low0, high1, low1;
+                multiply_wide(c0, multiplier0, high0, low0);
+                multiply_wide(c2, multiplier1, high1, low1);
+                c0 = _mm256_xor_si256(_mm256_xor_si256(high1, c1), _mm256_set1_epi32((i32)key0));
+                c2 = _mm256_xor_si256(_mm256_xor_si256(high0, c3), _mm256_set1_epi32((i32)key1));
+                c1 = low1;
+                c3 = low0;
+                key0 += 0x9E3779B9u;
+                key1 += 0xBB67AE85u;
+            }
+            __m256i high, low;
+            multiply_wide(c0, _mm256_set1_epi32((i32)n), high, low);
+            _mm256_storeu_si256((__m256i*)(rolls + i), high);
+        }
+        return i;
+    }
+#endif
+
+    // rolls[i] = roll(seed, positions[i], feature, n) for count positions
+    inline void roll_batch(u32 seed, const i32vec3 *positions, Feature feature, u32 n, u32 *rolls, usize count) {
+        usize i = 0;
+#ifdef WORLD_RNG_AVX2
+        static const bool has_avx2 = __builtin_cpu_supports("avx2");
+        if (has_avx2)
+            i = roll_batch_avx2(seed, positions, feature, n, rolls, count);
+#endif
+        for (; i < count; i++)
+            rolls[i] = roll(seed, positions[i], feature, n);
+    }
+}
@@ -0,0 +1,138 @@
+// Trains an LZ4 dictionary on the chunks saved in a world and writes it to
+// <world>/dictionaries/<id>.dict, where the game picks it up on the next start.
+//
+//   train_chunk_dictionary <world directory> [dictionary size in bytes]
+//
+// Segments are picked like zstd's COVER trainer: every k-byte sequence gets a count of how
+// often it occurs across all chunks, the data is split into one epoch per segment, and each
+// epoch contributes the segment whose sequences have the highest counts. Sequences already in
+// the dictionary stop counting, so later segments cover something new. The best segments end
+// up last, where LZ4 reaches them with the shortest offsets.
+#include <fstream>
+#include <algorithm>
+#include <lz4.h>
+
+#include "../src/world/chunk_codec.hpp"
+#include "../src/world/region_file.hpp"
+
+static constexpr usize kmer_size = 8;
+static constexpr usize segment_size = 64;
+static constexpr uint frequency_bits = 20;
+static constexpr usize max_samples_size = 64 * 1024 * 1024;
+
+static u32 kmer_slot(const u8 *data) {
+    u64 kmer;
+    std::memcpy(&kmer, data, sizeof(kmer));
+    return (u32)((kmer * 0x9E3779B185EBCA87ull) >> (64 - frequency_bits));
+}
+
+static std::vector<u8> train(const std::vector<u8> &samples, usize dictionary_size) {
+    std::vector<u32> frequencies(1 << frequency_bits);
+    usize num_kmers = samples.size() - kmer_size + 1;
+    std::vector<u32> slots(num_kmers);
+    for (usize i = 0; i < num_kmers; i++) {
+        slots[i] = kmer_slot(&samples[i]);
+        frequencies[slots[i]]++;
+    }
+
+    struct Segment {
+        usize begin;
+        u64 score;
+    };
+    std::vector<Segment> segments;
+    constexpr usize kmers_per_segment = segment_size - kmer_size + 1;
+    usize num_epochs = std::max<usize>(dictionary_size / segment_size, 1);
+    usize epoch_size = std::max(num_kmers / num_epochs, kmers_per_segment);
+    for (usize epoch_begin = 0; epoch_begin + kmers_per_segment <= num_kmers && segments.size() < num_epochs; epoch_begin += epoch_size) {
+        usize epoch_end = std::min(epoch_begin + epoch_size, num_kmers);
+
+        // slide a segment over the epoch, keeping the sum of its k-mer counts
+        Segment best { epoch_begin, 0 };
+        u64 score = 0;
+        for (usize i = epoch_begin; i < epoch_end; i++) {
+            score += frequencies[slots[i]];
+            if (i >= epoch_begin + kmers_per_segment)
+                score -= frequencies[slots[i - kmers_per_segment]];
+            if (i + 1 >= epoch_begin + kmers_per_segment && score > best.score)
+                best = { i + 1 - kmers_per_segment, score };
+        }
+        if (best.score == 0)
+            continue;
+
+        for (usize i = best.begin; i < best.begin + kmers_per_segment; i++)
+            frequencies[slots[i]] = 0;
+        segments.push_back(best);
+    }
+
+    std::sort(segments.begin(), segments.end(), [] (const Segment &a, const Segment &b) {
+        return a.score < b.score;
+    });
+    std::vector<u8> dictionary;
+    for (auto &segment : segments)
+        dictionary.insert(dictionary.end(), &samples[segment.begin], &samples[segment.begin] + segment_size);
+    return dictionary;
+}
+
+static usize compressed_size(const std::vector<std::vector<u8>> &samples, const std::vector<u8> &dictionary) {
+    usize total = 0;
+    std::vector<char> compressed;
+    for (auto &sample : samples) {
+        compressed.resize(LZ4_compressBound(sample.size()));
+        LZ4_stream_t stream;
+        LZ4_initStream(&stream, sizeof(stream));
+        LZ4_loadDict(&stream, (const char*)dictionary.data(), dictionary.size());
+        total += LZ4_compress_fast_continue(&stream, (const char*)sample.data(), compressed.data(), sample.size(), compressed.size(), 1);
+    }
+    return total;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        log(LogLevel::ERROR, "TrainDictionary", "Usage: {} <world directory> [dictionary size]", argv[0]);
+        return 1;
+    }
+    std::filesystem::path world_directory = argv[1];
+    usize dictionary_size = argc > 2 ? std::stoull(argv[2]) : 16 * 1024;
+    dictionary_size = std::clamp<usize>(dictionary_size, segment_size, chunk_codec::max_dictionary_size);
+    // payloads written with an earlier dictionary need it to be decompressed
+    chunk_codec::load_dictionaries(world_directory / "dictionaries");
+
+    std::vector<std::vector<u8>> samples;
+    std::vector<u8> all_samples;
+    for (auto &file : std::filesystem::directory_iterator(world_directory)) {
+        if (file.path().extension() != ".vkr")
+            continue;
+        RegionFile region(file.path(), false);
+        if (!region.is_open())
+            continue;
+
+        std::vector<u8> payload, original;
+        for (i32 i = 0; i < RegionFile::volume && all_samples.size() < max_samples_size; i++) {
+            i32vec3 local_pos(i % RegionFile::size, i / (RegionFile::size * RegionFile::size), i / RegionFile::size % RegionFile::size);
+            if (!region.read(local_pos, payload))
+                continue;
+            SerialReader reader(payload);
+            if (!chunk_codec::decompress(reader, original))
+                continue;
+            all_samples.insert(all_samples.end(), original.begin(), original.end());
+            samples.push_back(original);
+        }
+    }
+    if (all_samples.size() < dictionary_size * 4) {
+        log(LogLevel::ERROR, "TrainDictionary", "Only {} bytes in {} saved chunks, not enough to train a {} byte dictionary", all_samples.size(), samples.size(), dictionary_size);
+        return 1;
+    }
+
+    std::vector<u8> dictionary = train(all_samples, dictionary_size);
+    u32 id = chunk_codec::dictionary_id(dictionary);
+    auto path = world_directory / "dictionaries" / (std::to_string(id) + ".dict");
+    std::filesystem::create_directories(path.parent_path());
+    std::ofstream output(path, std::ios::binary);
+    output.write((const char*)dictionary.data(), dictionary.size());
+
+    usize without = compressed_size(samples, {}), with = compressed_size(samples, dictionary);
+    log(LogLevel::INFO, "TrainDictionary", "Trained {} byte dictionary {} on {} chunks ({} bytes)", dictionary.size(), id, samples.size(), all_samples.size());
+    log(LogLevel::INFO, "TrainDictionary", "{} bytes per chunk without it, {} with it ({}x smaller)", without / samples.size(), with / samples.size(), (f64)without / (f64)with);
+    log(LogLevel::INFO, "TrainDictionary", "Wrote {}", path);
+    return 0;
+}